@@ -6,7 +6,7 @@
 
 #include "treeview_extension.h"
 #include "utility.h"
-#include "bnk-extract/defs.h"
+#include "bnk-extract/api.h"
 
 typedef struct InternalIDropTarget {
     IDropTargetVtbl* _vTable;
@@ -171,12 +171,12 @@ static HRESULT STDMETHODCALLTYPE Drop(IDropTarget* This, IDataObject* pDataObj,
                         FILE* newDataFile = fopen(fileNameBuffer, "rb");
                         if (!newDataFile) continue;
                         fseek(newDataFile, 0, SEEK_END);
-                        wemData->length = ftell(newDataFile);
-                        free(wemData->data);
-                        wemData->data = malloc(wemData->length);
+                        uint32_t newDataLength = ftell(newDataFile);
+                        uint8_t* newData = malloc(newDataLength);
                         rewind(newDataFile);
-                        fread(wemData->data, wemData->length, 1, newDataFile);
+                        fread(newData, newDataLength, 1, newDataFile);
                         fclose(newDataFile);
+                        replace_audio_data(wemData, newData, newDataLength);
                     }
                 }
                 ReleaseStgMedium(&stgMedium);
@@ -1,11 +1,62 @@
 #ifndef BNK_EXTRACT_API_H
 #define BNK_EXTRACT_API_H
 
+#include "bin.h"
 #include "defs.h"
+#include "output_sink.h"
 
 // call like a main()
 WemInformation* bnk_extract(int argc, char* argv[]);
 
-BinaryData* WemToOgg(AudioData* wemData);
+// returns the events that play the wem with file_id, each paired with the switch container it is played through (0 for none).
+// count is set to their amount, 0 if the wem is played by no event or wem_information was read without events.
+const struct string_hash* find_wem_events(const WemInformation* wem_information, uint32_t file_id, uint32_t* count);
+
+// frees the events of a WemInformation, its wems and their grouping are freed separately
+void free_wem_events(WemEvents* wem_events);
+
+// long wems are split into parts converted on up to thread_count threads, 0 for one per cpu
+BinaryData* WemToOgg(AudioData* wemData, uint32_t thread_count);
+
+// writes the converted wem to output as it is produced. Returns -1 if it could not be converted, output may hold part of it then.
+int WriteWemAsOgg(AudioData* wemData, OutputSink* output, uint32_t thread_count);
+
+// gets the converted data of the wem at index, or NULL if it could not be converted. Takes ownership of ogg_data.
+typedef void (*WemConvertedCallback)(uint32_t index, AudioData* wem, BinaryData* ogg_data, void* user_data);
+
+// converts the wem_count wems pointed to by wems (all of audio_data_list if wems is NULL) on thread_count threads, 0 for one per cpu.
+// If ordered, the callback is called on the calling thread in the order of the wems, otherwise right away on the converting thread.
+// audio_data_list may only be NULL if wems is given and the wems are not loaded on demand.
+void convert_wems(AudioDataList* audio_data_list, AudioData** wems, uint32_t wem_count, uint32_t thread_count, bool ordered, WemConvertedCallback callback, void* user_data);
+
+// sets up the sink the wem at index gets written to, or returns false to skip the wem
+typedef bool (*OpenWemOutputCallback)(uint32_t index, AudioData* wem, OutputSink* output, void* user_data);
+
+// called once the wem at index has been written, with the status of WriteWemAsOgg
+typedef void (*WemWrittenCallback)(uint32_t index, AudioData* wem, OutputSink* output, int status, void* user_data);
+
+// like convert_wems, but writes every wem to its own sink while converting it instead of collecting the whole ogg first.
+// Both callbacks are called right away on the converting thread.
+void write_wems(AudioDataList* audio_data_list, AudioData** wems, uint32_t wem_count, uint32_t thread_count, OpenWemOutputCallback open_output, WemWrittenCallback written, void* user_data);
+
+// like write_wems, but as a pipeline: one thread reads the wems ahead in order, thread_count threads convert them
+// and the calling thread writes the converted output to the sinks. At most about memory_cap bytes of read wems and unwritten
+// output are held at once, half of it each; reading and converting wait for the stage after them once their half is used up.
+// open_output is called on the reading thread, written on the calling thread. Wems loaded on demand are kept in their cache
+// after use as usual, the pages of mapped ones are dropped again.
+void stream_wems(AudioDataList* audio_data_list, AudioData** wems, uint32_t wem_count, uint32_t thread_count, uint64_t memory_cap, OpenWemOutputCallback open_output, WemWrittenCallback written, void* user_data);
+
+// takes ownership of data
+void replace_audio_data(AudioData* audio_data, uint8_t* data, uint32_t length);
+
+// returns the wem's data, reading it first if the list is loaded on demand. Every call has to be paired with release_audio_data.
+uint8_t* acquire_audio_data(AudioDataList* audio_data_list, AudioData* audio_data);
+
+void release_audio_data(AudioDataList* audio_data_list, AudioData* audio_data);
+
+// returns -1 if a wem could not be read, the list stays usable in that case
+int detach_audio_data_list(AudioDataList* audio_data_list);
+
+void free_audio_data_list(AudioDataList* audio_data_list);
 
 #endif
@@ -0,0 +1,550 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "api.h"
+#include "defs.h"
+#include "general_utils.h"
+#include "mapped_file.h"
+
+// the wems a worker still has to convert. Other workers take from the end once they run out of their own.
+struct work_range {
+    pthread_mutex_t lock;
+    uint32_t next;
+    uint32_t end;
+};
+
+struct conversion_batch {
+    AudioDataList* audio_data_list;
+    AudioData** wems; // NULL to convert audio_data_list->objects
+    uint32_t worker_count;
+    struct work_range* ranges;
+    bool ordered;
+    WemConvertedCallback callback;
+    // set instead of callback if the wems are written to sinks
+    OpenWemOutputCallback open_output;
+    WemWrittenCallback written;
+    void* user_data;
+
+    // results that wait to be handed to the callback, only used if ordered
+    pthread_mutex_t results_lock;
+    pthread_cond_t result_ready;
+    BinaryData** results;
+    bool* finished;
+};
+
+struct conversion_worker {
+    struct conversion_batch* batch;
+    uint32_t index;
+};
+
+static bool take_own_work(struct work_range* range, uint32_t* wem_index)
+{
+    pthread_mutex_lock(&range->lock);
+    bool has_work = range->next < range->end;
+    if (has_work)
+        *wem_index = range->next++;
+    pthread_mutex_unlock(&range->lock);
+
+    return has_work;
+}
+
+// moves the back half of another worker's remaining wems over to own_range
+static bool steal_work(struct conversion_batch* batch, uint32_t worker_index, uint32_t* wem_index)
+{
+    for (uint32_t i = 1; i < batch->worker_count; i++) {
+        struct work_range* victim = &batch->ranges[(worker_index + i) % batch->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        uint32_t remaining = victim->end - victim->next;
+        uint32_t stolen = (remaining + 1) / 2;
+        victim->end -= stolen;
+        uint32_t begin = victim->end;
+        pthread_mutex_unlock(&victim->lock);
+        if (stolen == 0)
+            continue;
+
+        struct work_range* own_range = &batch->ranges[worker_index];
+        pthread_mutex_lock(&own_range->lock);
+        own_range->next = begin + 1;
+        own_range->end = begin + stolen;
+        pthread_mutex_unlock(&own_range->lock);
+        *wem_index = begin;
+        return true;
+    }
+
+    return false;
+}
+
+// gets wem with its data loaded into loaded_wem. Has to be paired with unload_wem if successful.
+static bool load_wem(AudioDataList* audio_data_list, AudioData* wem, AudioData* loaded_wem)
+{
+    if (!audio_data_list) {
+        *loaded_wem = *wem;
+        return true;
+    }
+
+    uint8_t* data = acquire_audio_data(audio_data_list, wem);
+    if (!data)
+        return false;
+    // the wem itself may be written to by another thread acquiring it at the same time
+    *loaded_wem = (AudioData) {
+        .id = wem->id,
+        .length = wem->length,
+        .data = data,
+        .owns_data = false
+    };
+
+    return true;
+}
+
+static void unload_wem(AudioDataList* audio_data_list, AudioData* wem)
+{
+    if (audio_data_list)
+        release_audio_data(audio_data_list, wem);
+}
+
+// a long wem would otherwise keep its worker busy long after the others have run out of wems,
+// it is split into parts for as many threads as there are workers
+static BinaryData* convert_wem(struct conversion_batch* batch, AudioData* wem)
+{
+    AudioData loaded_wem;
+    if (!load_wem(batch->audio_data_list, wem, &loaded_wem))
+        return NULL;
+    BinaryData* ogg_data = WemToOgg(&loaded_wem, batch->worker_count);
+    unload_wem(batch->audio_data_list, wem);
+
+    return ogg_data;
+}
+
+static void write_wem(struct conversion_batch* batch, uint32_t index, AudioData* wem)
+{
+    OutputSink output;
+    if (!batch->open_output(index, wem, &output, batch->user_data))
+        return;
+
+    int status = -1;
+    AudioData loaded_wem;
+    if (load_wem(batch->audio_data_list, wem, &loaded_wem)) {
+        status = WriteWemAsOgg(&loaded_wem, &output, batch->worker_count);
+        unload_wem(batch->audio_data_list, wem);
+    }
+    batch->written(index, wem, &output, status, batch->user_data);
+}
+
+static void* convert_wems_worker(void* argument)
+{
+    struct conversion_worker* worker = argument;
+    struct conversion_batch* batch = worker->batch;
+
+    uint32_t i;
+    while (take_own_work(&batch->ranges[worker->index], &i) || steal_work(batch, worker->index, &i)) {
+        AudioData* wem = batch->wems ? batch->wems[i] : &batch->audio_data_list->objects[i];
+        if (batch->open_output) {
+            write_wem(batch, i, wem);
+            continue;
+        }
+        BinaryData* ogg_data = convert_wem(batch, wem);
+        if (!batch->ordered) {
+            batch->callback(i, wem, ogg_data, batch->user_data);
+            continue;
+        }
+
+        pthread_mutex_lock(&batch->results_lock);
+        batch->results[i] = ogg_data;
+        batch->finished[i] = true;
+        pthread_cond_signal(&batch->result_ready);
+        pthread_mutex_unlock(&batch->results_lock);
+    }
+
+    return NULL;
+}
+
+// runs the workers for batch, which only has to have the wems and callbacks set
+static void run_batch(struct conversion_batch batch, uint32_t wem_count, uint32_t thread_count, bool ordered)
+{
+    AudioDataList* audio_data_list = batch.audio_data_list;
+    AudioData** wems = batch.wems;
+    if (!wems)
+        wem_count = audio_data_list->length;
+    if (wem_count == 0)
+        return;
+    if (thread_count == 0)
+        thread_count = get_cpu_count();
+    thread_count = min(thread_count, wem_count);
+
+    batch.worker_count = thread_count;
+    batch.ordered = ordered && thread_count > 1; // a single worker finishes the wems in order anyways
+    batch.ranges = malloc(thread_count * sizeof(struct work_range));
+    for (uint32_t i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&batch.ranges[i].lock, NULL);
+        batch.ranges[i].next = (uint64_t) wem_count * i / thread_count;
+        batch.ranges[i].end = (uint64_t) wem_count * (i + 1) / thread_count;
+    }
+    if (batch.ordered) {
+        pthread_mutex_init(&batch.results_lock, NULL);
+        pthread_cond_init(&batch.result_ready, NULL);
+        batch.results = malloc(wem_count * sizeof(BinaryData*));
+        batch.finished = calloc(wem_count, sizeof(bool));
+    }
+
+    struct conversion_worker* workers = malloc(thread_count * sizeof(struct conversion_worker));
+    pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+    uint32_t started_count = 0;
+    for (uint32_t i = 0; i < thread_count; i++) {
+        workers[i] = (struct conversion_worker) {.batch = &batch, .index = i};
+        if (thread_count > 1 && pthread_create(&threads[started_count], NULL, convert_wems_worker, &workers[i]) == 0)
+            started_count++;
+    }
+    // without any threads, the first worker steals the work of all others
+    if (started_count == 0)
+        convert_wems_worker(&workers[0]);
+
+    if (batch.ordered) {
+        for (uint32_t i = 0; i < wem_count; i++) {
+            pthread_mutex_lock(&batch.results_lock);
+            while (!batch.finished[i])
+                pthread_cond_wait(&batch.result_ready, &batch.results_lock);
+            BinaryData* ogg_data = batch.results[i];
+            pthread_mutex_unlock(&batch.results_lock);
+            batch.callback(i, wems ? wems[i] : &audio_data_list->objects[i], ogg_data, batch.user_data);
+        }
+    }
+
+    for (uint32_t i = 0; i < started_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (uint32_t i = 0; i < thread_count; i++) {
+        pthread_mutex_destroy(&batch.ranges[i].lock);
+    }
+    if (batch.ordered) {
+        pthread_mutex_destroy(&batch.results_lock);
+        pthread_cond_destroy(&batch.result_ready);
+        free(batch.results);
+        free(batch.finished);
+    }
+    free(threads);
+    free(workers);
+    free(batch.ranges);
+}
+
+void convert_wems(AudioDataList* audio_data_list, AudioData** wems, uint32_t wem_count, uint32_t thread_count, bool ordered, WemConvertedCallback callback, void* user_data)
+{
+    struct conversion_batch batch = {
+        .audio_data_list = audio_data_list,
+        .wems = wems,
+        .callback = callback,
+        .user_data = user_data
+    };
+    run_batch(batch, wem_count, thread_count, ordered);
+}
+
+void write_wems(AudioDataList* audio_data_list, AudioData** wems, uint32_t wem_count, uint32_t thread_count, OpenWemOutputCallback open_output, WemWrittenCallback written, void* user_data)
+{
+    struct conversion_batch batch = {
+        .audio_data_list = audio_data_list,
+        .wems = wems,
+        .open_output = open_output,
+        .written = written,
+        .user_data = user_data
+    };
+    run_batch(batch, wem_count, thread_count, false);
+}
+
+// what a converter collects before handing it to the writer, so that the queue isn't locked for every ogg page
+#define STAGED_OUTPUT_LENGTH (64 * 1024)
+
+// converted output waiting to be written, in the order it was produced
+struct output_piece {
+    struct output_piece* next;
+    uint32_t index;
+    bool last; // the wem is done after this piece, with status
+    int status;
+    uint64_t length;
+    uint8_t data[];
+};
+
+struct wem_stream {
+    AudioDataList* audio_data_list;
+    AudioData** wems; // NULL to write audio_data_list->objects
+    uint32_t wem_count;
+    OpenWemOutputCallback open_output;
+    WemWrittenCallback written;
+    void* user_data;
+
+    // everything below is only used with the lock held, the outputs are only used by the writer once opened
+    pthread_mutex_t lock;
+    pthread_cond_t input_released;
+    pthread_cond_t wem_loaded;
+    pthread_cond_t output_queued;
+    pthread_cond_t output_written;
+    OutputSink* outputs;
+    bool* write_failed;
+
+    // the wems read so far, converters take them from the front
+    AudioData* loaded;
+    uint32_t* loaded_queue;
+    uint32_t loaded_next;
+    uint32_t loaded_count;
+    bool reading_done;
+    uint64_t input_bytes;
+    uint64_t input_cap;
+
+    struct output_piece* first_piece;
+    struct output_piece* last_piece;
+    uint64_t output_bytes;
+    uint64_t output_cap;
+    uint32_t producer_count; // the reader and the converters that still run, the writer is done once they are and nothing is queued
+};
+
+struct stream_converter {
+    struct wem_stream* stream;
+    uint32_t index; // of the wem being converted
+    uint64_t staged_length;
+    uint8_t staged[STAGED_OUTPUT_LENGTH];
+};
+
+static AudioData* stream_wem(struct wem_stream* stream, uint32_t index)
+{
+    return stream->wems ? stream->wems[index] : &stream->audio_data_list->objects[index];
+}
+
+// waits until the writer has room for length more bytes, unless nothing is queued. Returns -1 if the wem's output failed already.
+static int queue_output(struct wem_stream* stream, uint32_t index, const uint8_t* data, uint64_t length, bool last, int status)
+{
+    struct output_piece* piece = malloc(sizeof(struct output_piece) + length);
+    *piece = (struct output_piece) {.index = index, .last = last, .status = status, .length = length};
+    if (length > 0)
+        memcpy(piece->data, data, length);
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->output_bytes > 0 && stream->output_bytes + length > stream->output_cap)
+        pthread_cond_wait(&stream->output_written, &stream->lock);
+    stream->output_bytes += length;
+    if (stream->last_piece)
+        stream->last_piece->next = piece;
+    else
+        stream->first_piece = piece;
+    stream->last_piece = piece;
+    pthread_cond_signal(&stream->output_queued);
+    bool failed = stream->write_failed[index];
+    pthread_mutex_unlock(&stream->lock);
+
+    return failed ? -1 : 0;
+}
+
+static int stage_output(const uint8_t* data, uint64_t length, void* _converter)
+{
+    struct stream_converter* converter = _converter;
+    int status = 0;
+    if (converter->staged_length + length > STAGED_OUTPUT_LENGTH) {
+        status = queue_output(converter->stream, converter->index, converter->staged, converter->staged_length, false, 0);
+        converter->staged_length = 0;
+    }
+    if (length > STAGED_OUTPUT_LENGTH)
+        return queue_output(converter->stream, converter->index, data, length, false, 0) == -1 ? -1 : status;
+
+    memcpy(&converter->staged[converter->staged_length], data, length);
+    converter->staged_length += length;
+    return status;
+}
+
+static void release_input(struct wem_stream* stream, uint64_t length)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->input_bytes -= length;
+    pthread_cond_signal(&stream->input_released);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void finish_producer(struct wem_stream* stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->producer_count--;
+    pthread_cond_signal(&stream->output_queued);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+static void* read_streamed_wems(void* argument)
+{
+    struct wem_stream* stream = argument;
+    AudioDataList* audio_data_list = stream->audio_data_list;
+
+    for (uint32_t i = 0; i < stream->wem_count; i++) {
+        AudioData* wem = stream_wem(stream, i);
+        if (!stream->open_output(i, wem, &stream->outputs[i], stream->user_data))
+            continue;
+
+        // a wem larger than the cap on its own still gets read once nothing else is held
+        pthread_mutex_lock(&stream->lock);
+        while (stream->input_bytes > 0 && stream->input_bytes + wem->length > stream->input_cap)
+            pthread_cond_wait(&stream->input_released, &stream->lock);
+        stream->input_bytes += wem->length;
+        pthread_mutex_unlock(&stream->lock);
+
+        if (!load_wem(audio_data_list, wem, &stream->loaded[i])) {
+            release_input(stream, wem->length);
+            queue_output(stream, i, NULL, 0, true, -1);
+            continue;
+        }
+        // mapped wems are only touched by the converter, start reading them from disk in the meantime
+        if (audio_data_list && audio_data_list->source && !wem->owns_data)
+            prefetch_mapped_range(audio_data_list->source, stream->loaded[i].data, wem->length);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->loaded_queue[stream->loaded_count++] = i;
+        pthread_cond_signal(&stream->wem_loaded);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    stream->reading_done = true;
+    pthread_cond_broadcast(&stream->wem_loaded);
+    pthread_mutex_unlock(&stream->lock);
+    finish_producer(stream);
+
+    return NULL;
+}
+
+static bool take_loaded_wem(struct wem_stream* stream, uint32_t* index)
+{
+    pthread_mutex_lock(&stream->lock);
+    while (stream->loaded_next == stream->loaded_count && !stream->reading_done)
+        pthread_cond_wait(&stream->wem_loaded, &stream->lock);
+    bool has_work = stream->loaded_next < stream->loaded_count;
+    if (has_work)
+        *index = stream->loaded_queue[stream->loaded_next++];
+    pthread_mutex_unlock(&stream->lock);
+
+    return has_work;
+}
+
+static void* convert_streamed_wems(void* argument)
+{
+    struct stream_converter* converter = argument;
+    struct wem_stream* stream = converter->stream;
+    AudioDataList* audio_data_list = stream->audio_data_list;
+
+    uint32_t i;
+    while (take_loaded_wem(stream, &i)) {
+        AudioData* wem = stream_wem(stream, i);
+        OutputSink output;
+        begin_callback_output(&output, stage_output, converter);
+        converter->index = i;
+        converter->staged_length = 0;
+        // the parts of a split wem would be held in memory outside of the cap, the other converters keep the cpus busy instead
+        int status = WriteWemAsOgg(&stream->loaded[i], &output, 1);
+
+        unload_wem(audio_data_list, wem);
+        if (audio_data_list && audio_data_list->source && !wem->owns_data)
+            release_mapped_range(audio_data_list->source, stream->loaded[i].data, wem->length);
+        release_input(stream, wem->length);
+        queue_output(stream, i, converter->staged, converter->staged_length, true, status);
+    }
+    finish_producer(stream);
+
+    return NULL;
+}
+
+// runs on the calling thread until every producer is done
+static void write_streamed_wems(struct wem_stream* stream)
+{
+    while (true) {
+        pthread_mutex_lock(&stream->lock);
+        while (!stream->first_piece && stream->producer_count > 0)
+            pthread_cond_wait(&stream->output_queued, &stream->lock);
+        struct output_piece* piece = stream->first_piece;
+        if (piece) {
+            stream->first_piece = piece->next;
+            if (!stream->first_piece)
+                stream->last_piece = NULL;
+        }
+        pthread_mutex_unlock(&stream->lock);
+        if (!piece)
+            return;
+
+        OutputSink* output = &stream->outputs[piece->index];
+        append_output(output, piece->data, piece->length);
+        if (piece->last)
+            stream->written(piece->index, stream_wem(stream, piece->index), output, output->failed ? -1 : piece->status, stream->user_data);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->output_bytes -= piece->length;
+        stream->write_failed[piece->index] = output->failed;
+        pthread_cond_broadcast(&stream->output_written);
+        pthread_mutex_unlock(&stream->lock);
+        free(piece);
+    }
+}
+
+void stream_wems(AudioDataList* audio_data_list, AudioData** wems, uint32_t wem_count, uint32_t thread_count, uint64_t memory_cap, OpenWemOutputCallback open_output, WemWrittenCallback written, void* user_data)
+{
+    if (!wems)
+        wem_count = audio_data_list->length;
+    if (wem_count == 0)
+        return;
+    if (thread_count == 0)
+        thread_count = get_cpu_count();
+    thread_count = min(thread_count, wem_count);
+
+    struct wem_stream stream = {
+        .audio_data_list = audio_data_list,
+        .wems = wems,
+        .wem_count = wem_count,
+        .open_output = open_output,
+        .written = written,
+        .user_data = user_data,
+        .outputs = malloc(wem_count * sizeof(OutputSink)),
+        .write_failed = calloc(wem_count, sizeof(bool)),
+        .loaded = malloc(wem_count * sizeof(AudioData)),
+        .loaded_queue = malloc(wem_count * sizeof(uint32_t)),
+        .input_cap = memory_cap / 2,
+        .output_cap = memory_cap - memory_cap / 2
+    };
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.input_released, NULL);
+    pthread_cond_init(&stream.wem_loaded, NULL);
+    pthread_cond_init(&stream.output_queued, NULL);
+    pthread_cond_init(&stream.output_written, NULL);
+
+    struct stream_converter* converters = malloc(thread_count * sizeof(struct stream_converter));
+    pthread_t* threads = malloc((thread_count + 1) * sizeof(pthread_t));
+    uint32_t started_count = 0;
+    for (uint32_t i = 0; i < thread_count; i++) {
+        converters[i].stream = &stream;
+        if (pthread_create(&threads[started_count], NULL, convert_streamed_wems, &converters[i]) == 0)
+            started_count++;
+    }
+    stream.producer_count = started_count + 1;
+    bool reading = started_count > 0 && pthread_create(&threads[started_count], NULL, read_streamed_wems, &stream) == 0;
+
+    if (reading) {
+        write_streamed_wems(&stream);
+        started_count++;
+    } else {
+        // the converters find nothing to convert and stop
+        pthread_mutex_lock(&stream.lock);
+        stream.reading_done = true;
+        pthread_cond_broadcast(&stream.wem_loaded);
+        pthread_mutex_unlock(&stream.lock);
+    }
+    for (uint32_t i = 0; i < started_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // without threads, every stage runs one after the other
+    if (!reading)
+        write_wems(audio_data_list, wems, wem_count, 1, open_output, written, user_data);
+
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.input_released);
+    pthread_cond_destroy(&stream.wem_loaded);
+    pthread_cond_destroy(&stream.output_queued);
+    pthread_cond_destroy(&stream.output_written);
+    free(threads);
+    free(converters);
+    free(stream.outputs);
+    free(stream.write_failed);
+    free(stream.loaded);
+    free(stream.loaded_queue);
+}
@@ -1,10 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
 
 #include "defs.h"
 #include "bin.h"
+#include "general_utils.h"
+#include "mapped_file.h"
+
+static const uint8_t signature[4] = {0x84, 0xe3, 0xd8, 0x12};
+
+// bins are only split between threads in chunks of at least this size
+#define MIN_CHUNK_SIZE (1 << 20)
+
+struct scan_chunk {
+    const MappedFile* bin_file;
+    uint64_t begin; // signatures starting in [begin, end) are searched for
+    uint64_t end;
+    uint64_list positions;
+};
 
 uint32_t fnv_1_hash(const char* input)
 {
@@ -19,20 +38,108 @@ uint32_t fnv_1_hash(const char* input)
     return hash;
 }
 
-// format: uint16 length, then (length) bytes string (not null-terminated).
-char* read_string(FILE* input) {
-    uint16_t string_length;
-    assert(fread(&string_length, 2, 1, input) == 1);
-    char* string = malloc(string_length + 1);
-    assert(fread(string, 1, string_length, input) == string_length);
-    string[string_length] = '\0';
+struct string_hash* find_string_hashes(const StringHashes* string_hashes, uint32_t hash, uint32_t* count)
+{
+    uint32_t low = 0, high = string_hashes->length;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (string_hashes->objects[middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    uint32_t end = low;
+    while (end < string_hashes->length && string_hashes->objects[end].hash == hash)
+        end++;
+
+    *count = end - low;
+    return *count ? &string_hashes->objects[low] : NULL;
+}
+
+// reads up to three bytes past end, so that signatures crossing into the next chunk are found by the chunk they start in
+static void* find_signatures(void* argument)
+{
+    struct scan_chunk* chunk = argument;
+    const uint8_t* data = chunk->bin_file->data;
+    uint64_t end = min(chunk->end, chunk->bin_file->length >= 4 ? chunk->bin_file->length - 3 : 0);
+
+    uint64_t i = chunk->begin;
+#ifdef __SSE2__
+    for (; i + 16 <= end; i += 16) {
+        __m128i matches = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &data[i]), _mm_set1_epi8((char) signature[0]));
+        if (!_mm_movemask_epi8(matches))
+            continue;
+        for (int j = 1; j < 4; j++) {
+            matches = _mm_and_si128(matches, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &data[i + j]), _mm_set1_epi8((char) signature[j])));
+        }
+        for (uint32_t mask = _mm_movemask_epi8(matches); mask; mask &= mask - 1) {
+            add_object(&chunk->positions, (&(uint64_t) {i + __builtin_ctz(mask)}));
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        if (data[i] == signature[0] && memcmp(&data[i], signature, 4) == 0)
+            add_object(&chunk->positions, &i);
+    }
+
+    return NULL;
+}
+
+// The old getc based scanner also consumed the byte that broke off a partial signature, so it never saw a signature right behind one.
+// Replays it from the last position it is known to have reached, to skip the same signatures it did.
+static bool is_reached(const uint8_t* data, uint64_t resume_position, uint64_t position)
+{
+    uint64_t current = position;
+    while (current > resume_position && (data[current - 1] == signature[0] || data[current - 1] == signature[1] || data[current - 1] == signature[2]))
+        current--;
+    while (current < position) {
+        uint32_t matched = 0;
+        while (matched < 3 && data[current + matched] == signature[matched])
+            matched++;
+        current += matched + 1;
+    }
+
+    return current == position;
+}
+
+static void find_all_signatures(const MappedFile* bin_file, uint64_list* positions)
+{
+    uint64_t chunk_count = min((uint64_t) get_cpu_count(), bin_file->length / MIN_CHUNK_SIZE);
+    if (chunk_count <= 1) {
+        struct scan_chunk chunk = {.bin_file = bin_file, .begin = 0, .end = bin_file->length, .positions = *positions};
+        find_signatures(&chunk);
+        *positions = chunk.positions;
+        return;
+    }
 
-    return string;
+    struct scan_chunk* chunks = malloc(chunk_count * sizeof(struct scan_chunk));
+    pthread_t* threads = malloc(chunk_count * sizeof(pthread_t));
+    bool* started = malloc(chunk_count * sizeof(bool));
+    for (uint64_t i = 0; i < chunk_count; i++) {
+        chunks[i] = (struct scan_chunk) {
+            .bin_file = bin_file,
+            .begin = bin_file->length * i / chunk_count,
+            .end = bin_file->length * (i + 1) / chunk_count
+        };
+        initialize_list(&chunks[i].positions);
+        started[i] = pthread_create(&threads[i], NULL, find_signatures, &chunks[i]) == 0;
+        if (!started[i])
+            find_signatures(&chunks[i]);
+    }
+    for (uint64_t i = 0; i < chunk_count; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        add_objects(positions, chunks[i].positions.objects, chunks[i].positions.length);
+        free(chunks[i].positions.objects);
+    }
+    free(started);
+    free(threads);
+    free(chunks);
 }
 
 StringHashes* parse_bin_file(char* bin_path)
 {
-    FILE* bin_file = fopen(bin_path, "rb");
+    MappedFile* bin_file = map_file(bin_path);
     if (!bin_file) {
         eprintf("Error: Failed to open \"%s\".\n", bin_path);
         return NULL;
@@ -41,21 +148,45 @@ StringHashes* parse_bin_file(char* bin_path)
     StringHashes* saved_strings = malloc(sizeof(StringHashes));
     initialize_list(saved_strings);
 
-    while (!feof(bin_file)) {
-        if (getc(bin_file) == 0x84 && getc(bin_file) == 0xe3 && getc(bin_file) == 0xd8 && getc(bin_file) == 0x12) {
-            fseek(bin_file, 6, SEEK_CUR);
-            uint32_t amount;
-            assert(fread(&amount, 4, 1, bin_file) == 1);
-            dprintf("amount: %u\n", amount);
-            for (uint32_t i = 0; i < amount; i++) {
-                char* string = read_string(bin_file);
-                struct string_hash new_pair = {
-                    .string = string,
-                    .hash = fnv_1_hash(string)
-                };
-                dprintf("saved string \"%s\"\n", string);
-                add_object(saved_strings, &new_pair);
-            }
+    uint64_list signature_positions;
+    initialize_list(&signature_positions);
+    find_all_signatures(bin_file, &signature_positions);
+
+    const uint8_t* data = bin_file->data;
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < signature_positions.length; i++) {
+        uint64_t signature_position = signature_positions.objects[i];
+        if (signature_position < position || !is_reached(data, position, signature_position))
+            continue;
+
+        // signature, 6 unknown bytes, then the amount of strings.
+        // format of a string: uint16 length, then (length) bytes string (not null-terminated).
+        position = signature_position + 10;
+        uint32_t amount;
+        if (position + 4 > bin_file->length)
+            goto truncated;
+        memcpy(&amount, &data[position], 4);
+        position += 4;
+        dprintf("amount: %u\n", amount);
+        for (uint32_t j = 0; j < amount; j++) {
+            uint16_t string_length;
+            if (position + 2 > bin_file->length)
+                goto truncated;
+            memcpy(&string_length, &data[position], 2);
+            position += 2;
+            if (position + string_length > bin_file->length)
+                goto truncated;
+            char* string = malloc(string_length + 1);
+            memcpy(string, &data[position], string_length);
+            string[string_length] = '\0';
+            position += string_length;
+
+            struct string_hash new_pair = {
+                .string = string,
+                .hash = fnv_1_hash(string)
+            };
+            dprintf("saved string \"%s\"\n", string);
+            add_object(saved_strings, &new_pair);
         }
     }
 
@@ -63,6 +194,18 @@ StringHashes* parse_bin_file(char* bin_path)
         dprintf("string at position %u: \"%s\".\n", i, saved_strings->objects[i].string);
     }
 
-    fclose(bin_file);
+    free(signature_positions.objects);
+    unmap_file(bin_file);
     return saved_strings;
+
+    truncated:
+    eprintf("Error: \"%s\" is truncated.\n", bin_path);
+    for (uint32_t i = 0; i < saved_strings->length; i++) {
+        free(saved_strings->objects[i].string);
+    }
+    free(saved_strings->objects);
+    free(saved_strings);
+    free(signature_positions.objects);
+    unmap_file(bin_file);
+    return NULL;
 }
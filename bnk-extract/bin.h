@@ -14,4 +14,14 @@ typedef LIST(struct string_hash) StringHashes;
 uint32_t fnv_1_hash(const char* input);
 StringHashes* parse_bin_file(char* bin_path);
 
+// the event strings that lead to every wem file, with the wem's file id as hash and sorted by it
+typedef struct wem_events {
+    StringHashes* event_strings; // as read from the bin file, the strings below point into these
+    StringHashes file_events;
+} WemEvents;
+
+// string_hashes must be sorted by hash. Returns the first entry with the given hash (NULL if there is none)
+// and sets count to the amount of entries carrying it, e.g. all event strings that lead to one wem file.
+struct string_hash* find_string_hashes(const StringHashes* string_hashes, uint32_t hash, uint32_t* count);
+
 #endif
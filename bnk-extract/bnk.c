@@ -3,18 +3,19 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <assert.h>
 
 #include "defs.h"
 #include "bin.h"
 #include "extract.h"
+#include "mapped_file.h"
 #include "static_list.h"
+#include "wem_cache.h"
 
 struct BNKFileEntry {
     uint32_t file_id;
     uint32_t offset;
     uint32_t length;
-    uint8_t* data;
+    uint64_t data_offset; // from the start of the file
 };
 
 struct BNKFile {
@@ -22,47 +23,62 @@ struct BNKFile {
     struct BNKFileEntry* entries;
 };
 
-uint32_t skip_to_section(FILE* bnk_file, char name[4], bool from_beginning)
+// like skip_to_section, on a bnk_file that may only hold the start of a file of file_length bytes
+static uint32_t find_section(const MappedFile* bnk_file, uint64_t file_length, uint64_t* position, char name[4])
 {
-    if (from_beginning)
-        fseek(bnk_file, 0, SEEK_SET);
-
-    uint8_t header[4];
-    uint32_t section_length = 0;
+    uint64_t offset = *position;
+    uint32_t section_length;
+
+    while (offset + 8 <= bnk_file->length) {
+        memcpy(&section_length, &bnk_file->data[offset + 4], 4);
+        if (memcmp(&bnk_file->data[offset], name, 4) == 0) {
+            if (offset + 8 + section_length > file_length)
+                return 0;
+            *position = offset + 8;
+            return section_length;
+        }
+        offset += 8 + (uint64_t) section_length;
+    }
 
-    do {
-        fseek(bnk_file, section_length, SEEK_CUR);
-        if (fread(header, 1, 4, bnk_file) != 4)
-            return 0;
-        assert(fread(&section_length, 4, 1, bnk_file) == 1);
-    } while (memcmp(header, name, 4) != 0);
+    return 0;
+}
 
-    return section_length;
+// looks for the section called name, starting at *position. On success, *position is set to the start of the section's data.
+uint32_t skip_to_section(const MappedFile* bnk_file, uint64_t* position, char name[4])
+{
+    return find_section(bnk_file, bnk_file->length, position, name);
 }
 
-int parse_bnk_file_entries(FILE* bnk_file, struct BNKFile* bnkfile)
+// bnk_file only needs to hold the file up to the header of the DATA section
+int parse_bnk_file_entries(const MappedFile* bnk_file, uint64_t file_length, struct BNKFile* bnkfile)
 {
-    uint32_t section_length = skip_to_section(bnk_file, "DIDX", false);
-    if (!section_length)
+    uint64_t position = 0;
+    uint32_t section_length = find_section(bnk_file, file_length, &position, "DIDX");
+    if (!section_length || position + section_length > bnk_file->length)
         return -1;
 
     bnkfile->length = section_length / 12;
     bnkfile->entries = malloc(bnkfile->length * sizeof(struct BNKFileEntry));
     for (uint32_t i = 0; i < bnkfile->length; i++) {
-        assert(fread(&bnkfile->entries[i].file_id, 4, 1, bnk_file) == 1);
-        assert(fread(&bnkfile->entries[i].offset, 4, 1, bnk_file) == 1);
-        assert(fread(&bnkfile->entries[i].length, 4, 1, bnk_file) == 1);
+        memcpy(&bnkfile->entries[i].file_id, &bnk_file->data[position + 12*i], 4);
+        memcpy(&bnkfile->entries[i].offset, &bnk_file->data[position + 12*i + 4], 4);
+        memcpy(&bnkfile->entries[i].length, &bnk_file->data[position + 12*i + 8], 4);
     }
 
-    section_length = skip_to_section(bnk_file, "DATA", false);
-    if (!section_length)
+    position += section_length;
+    section_length = find_section(bnk_file, file_length, &position, "DATA");
+    if (!section_length) {
+        free(bnkfile->entries);
         return -1;
+    }
 
-    uint32_t data_offset = ftell(bnk_file);
     for (uint32_t i = 0; i < bnkfile->length; i++) {
-        fseek(bnk_file, data_offset + bnkfile->entries[i].offset, SEEK_SET);
-        bnkfile->entries[i].data = malloc(bnkfile->entries[i].length);
-        assert(fread(bnkfile->entries[i].data, 1, bnkfile->entries[i].length, bnk_file) == bnkfile->entries[i].length);
+        if ((uint64_t) bnkfile->entries[i].offset + bnkfile->entries[i].length > section_length) {
+            eprintf("Error: Wem file %u lies outside of the DATA section.\n", bnkfile->entries[i].file_id);
+            free(bnkfile->entries);
+            return -1;
+        }
+        bnkfile->entries[i].data_offset = position + bnkfile->entries[i].offset;
     }
 
     return 0;
@@ -70,28 +86,30 @@ int parse_bnk_file_entries(FILE* bnk_file, struct BNKFile* bnkfile)
 
 WemInformation* parse_audio_bnk_file(char* bnk_path, StringHashes* string_hashes)
 {
-    FILE* bnk_file = fopen(bnk_path, "rb");
+    MappedFile* bnk_file = map_file(bnk_path);
     if (!bnk_file) {
         eprintf("Error: Failed to open \"%s\".\n", bnk_path);
         return NULL;
     }
 
     struct BNKFile bnkfile;
-    if (parse_bnk_file_entries(bnk_file, &bnkfile) == -1) {
+    if (parse_bnk_file_entries(bnk_file, bnk_file->length, &bnkfile) == -1) {
         eprintf("Error: Failed to find the required sections in file \"%s\". Make sure to provide the correct file.\n", bnk_path);
-        fclose(bnk_file);
+        unmap_file(bnk_file);
         return NULL;
     }
-    fclose(bnk_file);
 
-    WemInformation* wem_information = malloc(sizeof(WemInformation));
-    wem_information->sortedWemDataList = malloc(sizeof(AudioDataList));
+    WemInformation* wem_information = calloc(1, sizeof(WemInformation));
+    wem_information->sortedWemDataList = calloc(1, sizeof(AudioDataList));
     initialize_static_list(wem_information->sortedWemDataList, bnkfile.length);
+    wem_information->sortedWemDataList->source = bnk_file;
+    // no copies here, the entries point straight into the mapped DATA section
     for (uint32_t i = 0; i < bnkfile.length; i++) {
         wem_information->sortedWemDataList->objects[i] = (AudioData) {
             .id = bnkfile.entries[i].file_id,
             .length = bnkfile.entries[i].length,
-            .data = bnkfile.entries[i].data
+            .data = &bnk_file->data[bnkfile.entries[i].data_offset],
+            .owns_data = false
         };
     }
     sort_static_list(wem_information->sortedWemDataList, id);
@@ -102,3 +120,57 @@ WemInformation* parse_audio_bnk_file(char* bnk_path, StringHashes* string_hashes
 
     return wem_information;
 }
+
+// reads the sections of the bnk up to the header of DATA, which is all there is to the index of an audio bnk
+static int read_bnk_index(WemCache* wem_cache, MappedFile* bnk_index)
+{
+    uint64_t offset = 0;
+    uint32_t section_length;
+
+    while (read_file_start(wem_cache, bnk_index, offset + 8) == 0) {
+        if (memcmp(&bnk_index->data[offset], "DATA", 4) == 0)
+            return 0;
+        memcpy(&section_length, &bnk_index->data[offset + 4], 4);
+        offset += 8 + (uint64_t) section_length;
+        if (read_file_start(wem_cache, bnk_index, offset) == -1)
+            return -1;
+    }
+
+    return -1;
+}
+
+WemInformation* parse_audio_bnk_index(char* bnk_path, StringHashes* string_hashes, uint64_t cache_size)
+{
+    WemCache* wem_cache = open_wem_cache(bnk_path, cache_size);
+    if (!wem_cache)
+        return NULL;
+
+    MappedFile bnk_index = {0};
+    struct BNKFile bnkfile;
+    if (read_bnk_index(wem_cache, &bnk_index) == -1 || parse_bnk_file_entries(&bnk_index, wem_cache_file_length(wem_cache), &bnkfile) == -1) {
+        eprintf("Error: Failed to find the required sections in file \"%s\". Make sure to provide the correct file.\n", bnk_path);
+        free(bnk_index.data);
+        close_wem_cache(wem_cache);
+        return NULL;
+    }
+    free(bnk_index.data);
+
+    WemLocations locations;
+    initialize_static_list(&locations, bnkfile.length);
+    for (uint32_t i = 0; i < bnkfile.length; i++) {
+        locations.objects[i] = (struct wem_location) {
+            .id = bnkfile.entries[i].file_id,
+            .length = bnkfile.entries[i].length,
+            .offset = bnkfile.entries[i].data_offset
+        };
+    }
+    free(bnkfile.entries);
+
+    WemInformation* wem_information = calloc(1, sizeof(WemInformation));
+    wem_information->sortedWemDataList = make_lazy_audio_data_list(wem_cache, &locations);
+    free(locations.objects);
+
+    wem_information->grouped_wems = group_wems(wem_information->sortedWemDataList, string_hashes);
+
+    return wem_information;
+}
@@ -5,9 +5,12 @@
 #include <stdio.h>
 #include "bin.h"
 #include "defs.h"
+#include "mapped_file.h"
 
-uint32_t skip_to_section(FILE* bnk_file, char name[4], bool from_beginning);
+uint32_t skip_to_section(const MappedFile* bnk_file, uint64_t* position, char name[4]);
 
 WemInformation* parse_audio_bnk_file(char* bnk_path, StringHashes* string_hashes);
+// reads only DIDX and loads the wems from the file on demand, keeping at most cache_size bytes of unused ones
+WemInformation* parse_audio_bnk_index(char* bnk_path, StringHashes* string_hashes, uint64_t cache_size);
 
 #endif
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <inttypes.h>
 
 #include "list.h"
@@ -28,8 +29,16 @@ typedef struct audio_data {
     uint32_t id;
     uint32_t length;
     uint8_t* data;
+    bool owns_data; // false if data points into the list's mapped source file or its cache
 } AudioData;
-typedef STATIC_LIST(AudioData) AudioDataList;
+
+// same layout as a STATIC_LIST(AudioData), so the static list macros work on it
+typedef struct {
+    uint64_t length;
+    AudioData* objects;
+    struct mapped_file* source;
+    struct wem_cache* cache; // set instead of source if the wems are only loaded on demand
+} AudioDataList;
 
 typedef LIST(struct stringWithChildren) StringWithChildrenList;
 
@@ -42,6 +51,7 @@ typedef struct stringWithChildren {
 typedef struct {
     StringWithChildren* grouped_wems;
     AudioDataList* sortedWemDataList;
+    struct wem_events* wem_events; // which events play each wem, NULL if no events were given
 } WemInformation;
 
 #ifdef DEBUG
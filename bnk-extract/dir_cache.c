@@ -0,0 +1,96 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dir_cache.h"
+
+struct dir_cache {
+    int base_dir;
+    uint32_t length;
+    uint32_t slot_mask;
+    char** slots; // the created paths, NULL for unused slots
+};
+
+DirCache* open_dir_cache(int base_dir)
+{
+    DirCache* dir_cache = malloc(sizeof(DirCache));
+    *dir_cache = (DirCache) {.base_dir = base_dir, .slot_mask = 63};
+    dir_cache->slots = calloc(64, sizeof(char*));
+
+    return dir_cache;
+}
+
+static char** find_slot(char** slots, uint32_t slot_mask, const char* path, size_t length)
+{
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t) path[i]) * 0x01000193;
+    }
+    uint32_t i = hash & slot_mask;
+    while (slots[i] && (strncmp(slots[i], path, length) != 0 || slots[i][length] != '\0'))
+        i = (i + 1) & slot_mask;
+
+    return &slots[i];
+}
+
+static void add_path(DirCache* dir_cache, const char* path, size_t length)
+{
+    if (2 * (dir_cache->length + 1) > dir_cache->slot_mask + 1) {
+        uint32_t slot_mask = 2 * dir_cache->slot_mask + 1;
+        char** slots = calloc(slot_mask + 1, sizeof(char*));
+        for (uint32_t i = 0; i <= dir_cache->slot_mask; i++) {
+            if (dir_cache->slots[i])
+                *find_slot(slots, slot_mask, dir_cache->slots[i], strlen(dir_cache->slots[i])) = dir_cache->slots[i];
+        }
+        free(dir_cache->slots);
+        dir_cache->slots = slots;
+        dir_cache->slot_mask = slot_mask;
+    }
+
+    *find_slot(dir_cache->slots, dir_cache->slot_mask, path, length) = strndup(path, length);
+    dir_cache->length++;
+}
+
+// creates the first length characters of path
+static int create_dirs_at(DirCache* dir_cache, const char* path, size_t length)
+{
+    // "a//b" and "a/" name the same directories as "a/b" and "a"
+    while (length > 0 && path[length - 1] == '/')
+        length--;
+    if (length == 0 || *find_slot(dir_cache->slots, dir_cache->slot_mask, path, length))
+        return 0;
+
+    // only the parents that aren't known yet get created, usually none
+    size_t parent_length = length;
+    while (parent_length > 0 && path[parent_length - 1] != '/')
+        parent_length--;
+    if (create_dirs_at(dir_cache, path, parent_length) == -1)
+        return -1;
+
+    char* dir_path = strndup(path, length);
+    int ret = mkdirat(dir_cache->base_dir, dir_path, 0755);
+    free(dir_path);
+    if (ret == -1 && errno != EEXIST)
+        return -1;
+    add_path(dir_cache, path, length);
+
+    return 0;
+}
+
+int create_cached_dirs(DirCache* dir_cache, const char* path)
+{
+    return create_dirs_at(dir_cache, path, strlen(path));
+}
+
+void close_dir_cache(DirCache* dir_cache)
+{
+    for (uint32_t i = 0; i <= dir_cache->slot_mask; i++) {
+        free(dir_cache->slots[i]);
+    }
+    free(dir_cache->slots);
+    free(dir_cache);
+}
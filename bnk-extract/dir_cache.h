@@ -0,0 +1,17 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+// creates directories relative to a base directory and remembers the ones that exist already,
+// so that the files of a directory only cost a lookup instead of creating every parent again.
+// Not safe to use from multiple threads at once.
+typedef struct dir_cache DirCache;
+
+// base_dir stays owned by the caller, AT_FDCWD for the working directory
+DirCache* open_dir_cache(int base_dir);
+
+// creates the directory at path (relative to the base directory) and all of its parents, returns -1 if one could not be created
+int create_cached_dirs(DirCache* dir_cache, const char* path);
+
+void close_dir_cache(DirCache* dir_cache);
+
+#endif
@@ -4,81 +4,241 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "api.h"
 #include "bin.h"
 #include "defs.h"
 #include "general_utils.h"
+#include "mapped_file.h"
+#include "output_sink.h"
+#include "wem_cache.h"
 #include "ww2ogg/api.h"
-#include "revorb/api.h"
 
-BinaryData* WemToOgg(AudioData* wemData)
+static struct ww2ogg_options wem_options(uint32_t thread_count)
 {
-    char data_pointer[17] = {0};
-    bytes2hex(&wemData, data_pointer, 8);
-    char* ww2ogg_args[] = {"", "--audiodata", data_pointer, NULL};
-    BinaryData* raw_ogg = ww2ogg(sizeof(ww2ogg_args) / sizeof(ww2ogg_args[0]) - 1, ww2ogg_args);
-    if (!raw_ogg)
+    return (struct ww2ogg_options) {
+        .recompute_granules = true,
+        .thread_count = thread_count == 0 ? get_cpu_count() : thread_count
+    };
+}
+
+int WriteWemAsOgg(AudioData* wemData, OutputSink* output, uint32_t thread_count)
+{
+    struct ww2ogg_options options = wem_options(thread_count);
+    return ww2ogg_convert_to_sink(wemData, &options, output);
+}
+
+BinaryData* WemToOgg(AudioData* wemData, uint32_t thread_count)
+{
+    struct ww2ogg_options options = wem_options(thread_count);
+    BinaryData* converted_ogg_data = calloc(1, sizeof(BinaryData));
+    if (ww2ogg_convert(wemData, &options, converted_ogg_data) == -1) {
+        free(converted_ogg_data->data);
+        free(converted_ogg_data);
         return NULL;
+    }
 
-    if (memcmp(raw_ogg->data, "RIFF", 4) == 0) { // got a wav file instead of an ogg one
-        return raw_ogg;
-    } else {
-        bytes2hex(&raw_ogg, data_pointer, 8);
-        const char* revorb_args[] = {"", data_pointer, NULL};
-        BinaryData* converted_ogg_data = revorb(sizeof(revorb_args) / sizeof(revorb_args[0]) - 1, revorb_args);
-        free(raw_ogg->data);
-        free(raw_ogg);
+    return converted_ogg_data;
+}
 
-        return converted_ogg_data;
+void replace_audio_data(AudioData* audio_data, uint8_t* data, uint32_t length)
+{
+    if (audio_data->owns_data)
+        free(audio_data->data);
+    audio_data->data = data;
+    audio_data->length = length;
+    audio_data->owns_data = true;
+}
+
+uint8_t* acquire_audio_data(AudioDataList* audio_data_list, AudioData* audio_data)
+{
+    if (!audio_data_list->cache)
+        return audio_data->data;
+
+    return wem_cache_acquire(audio_data_list->cache, audio_data);
+}
+
+void release_audio_data(AudioDataList* audio_data_list, AudioData* audio_data)
+{
+    if (audio_data_list->cache)
+        wem_cache_release(audio_data_list->cache, audio_data);
+}
+
+// copies every wem that still points into the mapped source file or the cache, so that the source file can be released (or overwritten)
+int detach_audio_data_list(AudioDataList* audio_data_list)
+{
+    if (!audio_data_list->source && !audio_data_list->cache)
+        return 0;
+
+    for (uint64_t i = 0; i < audio_data_list->length; i++) {
+        AudioData* audio_data = &audio_data_list->objects[i];
+        if (!audio_data->owns_data) {
+            uint8_t* data = acquire_audio_data(audio_data_list, audio_data);
+            if (!data)
+                return -1;
+            uint8_t* data_copy = malloc(audio_data->length);
+            memcpy(data_copy, data, audio_data->length);
+            release_audio_data(audio_data_list, audio_data);
+            audio_data->data = data_copy;
+            audio_data->owns_data = true;
+        }
+    }
+    unmap_file(audio_data_list->source);
+    audio_data_list->source = NULL;
+    close_wem_cache(audio_data_list->cache);
+    audio_data_list->cache = NULL;
+
+    return 0;
+}
+
+void free_audio_data_list(AudioDataList* audio_data_list)
+{
+    for (uint64_t i = 0; i < audio_data_list->length; i++) {
+        if (audio_data_list->objects[i].owns_data)
+            free(audio_data_list->objects[i].data);
+    }
+    unmap_file(audio_data_list->source);
+    close_wem_cache(audio_data_list->cache);
+    free(audio_data_list->objects);
+    free(audio_data_list);
+}
+
+const struct string_hash* find_wem_events(const WemInformation* wem_information, uint32_t file_id, uint32_t* count)
+{
+    if (!wem_information->wem_events) {
+        *count = 0;
+        return NULL;
     }
+
+    return find_string_hashes(&wem_information->wem_events->file_events, file_id, count);
+}
+
+void free_wem_events(WemEvents* wem_events)
+{
+    if (!wem_events)
+        return;
+
+    for (uint32_t i = 0; i < wem_events->event_strings->length; i++) {
+        free(wem_events->event_strings->objects[i].string);
+    }
+    free(wem_events->event_strings->objects);
+    free(wem_events->event_strings);
+    free(wem_events->file_events.objects);
+    free(wem_events);
+}
+
+// Finds nodes by their string among the children of the root and of the root's children, the only nodes group_wems searches in.
+// Only the first child per string is kept, which is the one a linear search would have found.
+struct child_entry {
+    const char* string; // NULL for unused slots
+    uint32_t parent; // index of the parent in the root's children, or ROOT_NODE
+    uint32_t index;
+};
+
+struct child_map {
+    uint32_t length;
+    uint32_t slot_mask;
+    struct child_entry* slots;
+};
+
+#define ROOT_NODE UINT32_MAX
+#define NO_CHILD UINT32_MAX
+
+static struct child_entry* find_child_slot(const struct child_map* child_map, uint32_t parent, const char* string)
+{
+    uint32_t hash = 0x811c9dc5 ^ parent;
+    for (const char* c = string; *c; c++) {
+        hash = (hash ^ (uint8_t) *c) * 0x01000193;
+    }
+    uint32_t i = hash & child_map->slot_mask;
+    while (child_map->slots[i].string && (child_map->slots[i].parent != parent || strcmp(child_map->slots[i].string, string) != 0))
+        i = (i + 1) & child_map->slot_mask;
+
+    return &child_map->slots[i];
+}
+
+static uint32_t find_child(const struct child_map* child_map, uint32_t parent, const char* string)
+{
+    const struct child_entry* slot = find_child_slot(child_map, parent, string);
+    return slot->string ? slot->index : NO_CHILD;
+}
+
+// string has to stay valid as long as the map is used
+static void add_child(struct child_map* child_map, uint32_t parent, const char* string, uint32_t index)
+{
+    if (2 * (child_map->length + 1) > child_map->slot_mask + 1) {
+        struct child_map grown = {.length = 0, .slot_mask = 2 * child_map->slot_mask + 1};
+        grown.slots = calloc(grown.slot_mask + 1, sizeof(struct child_entry));
+        for (uint32_t i = 0; i <= child_map->slot_mask; i++) {
+            if (child_map->slots[i].string)
+                *find_child_slot(&grown, child_map->slots[i].parent, child_map->slots[i].string) = child_map->slots[i];
+        }
+        grown.length = child_map->length;
+        free(child_map->slots);
+        *child_map = grown;
+    }
+
+    struct child_entry* slot = find_child_slot(child_map, parent, string);
+    if (!slot->string) {
+        *slot = (struct child_entry) {string, parent, index};
+        child_map->length++;
+    }
+}
+
+// returns the index of the newly added node in list
+static uint32_t add_node(StringWithChildrenList* list, const char* string, AudioData* wem_data)
+{
+    StringWithChildren new_object = {.string = strdup(string), .wemData = wem_data};
+    if (!wem_data)
+        initialize_list(&new_object.children);
+    add_object(list, &new_object);
+
+    return list->length - 1;
 }
 
 StringWithChildren* group_wems(AudioDataList* audio_data, StringHashes* string_hashes)
 {
     StringWithChildren* grouped_wems = calloc(1, sizeof(StringWithChildren));
     initialize_list(&grouped_wems->children);
+    StringWithChildrenList* root = &grouped_wems->children;
+    struct child_map children = {.slot_mask = 15};
+    children.slots = calloc(16, sizeof(struct child_entry));
 
     for (uint32_t i = 0; i < audio_data->length; i++) {
-        bool inserted = false;
-        for (uint32_t string_index = 0; string_index < string_hashes->length; string_index++) {
-            if (string_hashes->objects[string_index].hash == audio_data->objects[i].id) {
-                StringWithChildrenList* current_root = &grouped_wems->children;
-                bool do_again = true;
-                find_object:;
-                bool found = false;
-                uint32_t j;
+        AudioData* wem_data = &audio_data->objects[i];
+        char wem_name[15];
+        sprintf(wem_name, "%u.wem", wem_data->id);
+
+        uint32_t string_count;
+        struct string_hash* string_hash = find_string_hashes(string_hashes, wem_data->id, &string_count);
+        for (uint32_t j = 0; j < string_count; j++, string_hash++) {
+            uint32_t event_index = find_child(&children, ROOT_NODE, string_hash->string);
+            if (event_index == NO_CHILD) {
+                event_index = add_node(root, string_hash->string, NULL);
+                add_child(&children, ROOT_NODE, root->objects[event_index].string, event_index);
+            }
+            StringWithChildren* event_node = &root->objects[event_index];
+
+            if (string_hash->switch_id) {
                 char switch_id[11];
-                if (!do_again) {
-                    sprintf(switch_id, "%u", string_hashes->objects[string_index].switch_id);
-                }
-                for (j = 0; j < current_root->length; j++) {
-                    if ((!do_again && strcmp(current_root->objects[j].string, switch_id) == 0) ||
-                        (strcmp(current_root->objects[j].string, string_hashes->objects[string_index].string) == 0)) {
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found) {
-                    StringWithChildren newObject = {.string = do_again ? strdup(string_hashes->objects[string_index].string) : strdup(switch_id)};
-                    initialize_list(&newObject.children);
-                    add_object(current_root, &newObject);
-                }
-                if (do_again && string_hashes->objects[string_index].switch_id) {
-                    do_again = false;
-                    current_root = &grouped_wems->children.objects[j].children;
-                    goto find_object;
+                sprintf(switch_id, "%u", string_hash->switch_id);
+                // the search among an event's children used to accept the event string as well
+                uint32_t switch_index = min(find_child(&children, event_index, switch_id), find_child(&children, event_index, string_hash->string));
+                if (switch_index == NO_CHILD) {
+                    switch_index = add_node(&event_node->children, switch_id, NULL);
+                    add_child(&children, event_index, event_node->children.objects[switch_index].string, switch_index);
                 }
-                char wem_name[15];
-                sprintf(wem_name, "%u.wem", audio_data->objects[i].id);
-                add_object(&current_root->objects[j].children, (&(StringWithChildren) {.string = strdup(wem_name), .wemData = &audio_data->objects[i]}));
-                inserted = true;
+                add_node(&event_node->children.objects[switch_index].children, wem_name, wem_data);
+            } else {
+                uint32_t wem_index = add_node(&event_node->children, wem_name, wem_data);
+                add_child(&children, event_index, event_node->children.objects[wem_index].string, wem_index);
             }
         }
-        if (!inserted) {
-            char wem_name[15];
-            sprintf(wem_name, "%u.wem", audio_data->objects[i].id);
-            add_object(&grouped_wems->children, (&(StringWithChildren) {.string = strdup(wem_name), .wemData = &audio_data->objects[i]}));
+        if (string_count == 0) {
+            uint32_t wem_index = add_node(root, wem_name, wem_data);
+            add_child(&children, ROOT_NODE, root->objects[wem_index].string, wem_index);
         }
     }
+    free(children.slots);
 
     return grouped_wems;
 }
@@ -4,6 +4,7 @@
 #include "defs.h"
 #include "bin.h"
 
+// string_hashes must be sorted by hash
 StringWithChildren* group_wems(AudioDataList* audio_data_list, StringHashes* string_hashes);
 
 #endif
@@ -1,14 +1,14 @@
 #ifndef _WIN32
-#   include <sys/stat.h>
+#   include <unistd.h>
 #else
 #   include <unistd.h>
+#   include <windows.h>
 #endif
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
-#include <errno.h>
 
 #include "general_utils.h"
 #include "defs.h"
@@ -64,31 +64,15 @@ void bytes2hex(const void* input, char* output, int input_length)
     }
 }
 
-int create_dir(char* path)
+uint32_t get_cpu_count(void)
 {
-    int ret = mkdir(path, 0700);
-    if (ret == -1 && errno != EEXIST)
-        return -1;
-    return 0;
-}
+#ifdef _WIN32
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    long cpu_count = system_info.dwNumberOfProcessors;
+#else
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
-int create_dirs(char* dir_path, bool create_last)
-{
-    char* c = dir_path;
-    if (strlen(c) >= 3 && c[1] == ':' && (c[2] == '\\' || c[2] == '/'))
-        c += 3;
-    while (*c != 0) {
-        c++;
-        if (*c == '/' || *c == '\\') {
-            char _c = *c;
-            *c = '\0';
-            int ret = create_dir(dir_path);
-            *c = _c;
-            if (ret == -1)
-                return -1;
-        }
-    }
-    if (create_last && create_dir(dir_path) == -1)
-        return -1;
-    return 0;
+    return cpu_count > 0 ? cpu_count : 1;
 }
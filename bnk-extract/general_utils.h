@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 
 char* lower(const char* string);
 
@@ -15,9 +16,7 @@ void hex2bytes(const char* input, void* output, int input_length);
 
 void bytes2hex(const void* input, char* output, int input_length);
 
-int create_dir(char* path);
-
-int create_dirs(char* dir_path, bool create_last);
+uint32_t get_cpu_count(void);
 
 #ifdef __cplusplus
 }
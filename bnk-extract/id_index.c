@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "id_index.h"
+
+static struct id_slot* find_slot(const IdIndex* id_index, uint32_t id)
+{
+    uint32_t hash = id * 0x9e3779b1;
+    uint32_t i = (hash ^ (hash >> 16)) & id_index->slot_mask;
+    while (id_index->slots[i].length != 0 && id_index->slots[i].id != id)
+        i = (i + 1) & id_index->slot_mask;
+
+    return &id_index->slots[i];
+}
+
+void initialize_id_index(IdIndex* id_index)
+{
+    initialize_list(&id_index->entries);
+    id_index->slot_mask = 0;
+    id_index->slots = NULL;
+    id_index->positions = NULL;
+}
+
+void add_id(IdIndex* id_index, uint32_t id, uint32_t position)
+{
+    add_object(&id_index->entries, (&(struct id_position) {id, position}));
+}
+
+void build_id_index(IdIndex* id_index)
+{
+    uint32_t slot_count = 16;
+    while (slot_count < id_index->entries.length * 2)
+        slot_count *= 2;
+    id_index->slot_mask = slot_count - 1;
+    id_index->slots = calloc(slot_count, sizeof(struct id_slot));
+
+    // count the positions per id, then hand out consecutive ranges of the positions array and fill them in the order they were added
+    for (uint32_t i = 0; i < id_index->entries.length; i++) {
+        struct id_slot* slot = find_slot(id_index, id_index->entries.objects[i].id);
+        slot->id = id_index->entries.objects[i].id;
+        slot->length++;
+    }
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < slot_count; i++) {
+        id_index->slots[i].start = start;
+        start += id_index->slots[i].length;
+    }
+    id_index->positions = malloc(id_index->entries.length * sizeof(uint32_t) + 1);
+    uint32_t* filled = calloc(slot_count, sizeof(uint32_t));
+    for (uint32_t i = 0; i < id_index->entries.length; i++) {
+        struct id_slot* slot = find_slot(id_index, id_index->entries.objects[i].id);
+        id_index->positions[slot->start + filled[slot - id_index->slots]++] = id_index->entries.objects[i].position;
+    }
+    free(filled);
+
+    free(id_index->entries.objects);
+    id_index->entries.objects = NULL;
+    id_index->entries.length = 0;
+}
+
+const uint32_t* find_id(const IdIndex* id_index, uint32_t id, uint32_t* count)
+{
+    const struct id_slot* slot = find_slot(id_index, id);
+    *count = slot->length;
+
+    return &id_index->positions[slot->start];
+}
+
+void free_id_index(IdIndex* id_index)
+{
+    free(id_index->entries.objects);
+    free(id_index->slots);
+    free(id_index->positions);
+}
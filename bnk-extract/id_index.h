@@ -0,0 +1,40 @@
+#ifndef ID_INDEX_H
+#define ID_INDEX_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+struct id_position {
+    uint32_t id;
+    uint32_t position;
+};
+
+struct id_slot {
+    uint32_t id;
+    uint32_t start;
+    uint32_t length; // 0 for unused slots
+};
+
+// hash index from 32 bit ids to the positions of all objects carrying that id (e.g. in a section list).
+// Positions come back in the order they were added.
+typedef struct {
+    LIST(struct id_position) entries; // only used while building
+    uint32_t slot_mask;
+    struct id_slot* slots;
+    uint32_t* positions;
+} IdIndex;
+
+void initialize_id_index(IdIndex* id_index);
+
+// must not be called after build_id_index
+void add_id(IdIndex* id_index, uint32_t id, uint32_t position);
+
+void build_id_index(IdIndex* id_index);
+
+// returns the positions for id, count is set to their amount (0 if id is unknown)
+const uint32_t* find_id(const IdIndex* id_index, uint32_t id, uint32_t* count);
+
+void free_id_index(IdIndex* id_index);
+
+#endif
@@ -0,0 +1,250 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "api.h"
+#include "defs.h"
+#include "dir_cache.h"
+#include "general_utils.h"
+#include "mapped_file.h"
+#include "output_sink.h"
+
+FILE* consoleless_stderr;
+
+struct extracted_wem {
+    struct extraction* extraction;
+    AudioData* wem;
+    char* path; // relative to the output directory, without extension
+    const char* extension; // of the converted output, set once its first bytes are known
+    int file;
+    OutputSink file_output;
+};
+
+struct extraction {
+    int output_dir;
+    AudioDataList* audio_data_list;
+    LIST(struct extracted_wem) wems;
+
+    // for the threads writing the wems
+    pthread_mutex_t lock;
+    uint32_t next_wem;
+    uint32_t failed_count;
+};
+
+// adds every wem below node to the extraction, after creating the directories they go into
+static void collect_wems(struct extraction* extraction, DirCache* dir_cache, StringWithChildren* node, const char* dir_path)
+{
+    for (uint32_t i = 0; i < node->children.length; i++) {
+        StringWithChildren* child = &node->children.objects[i];
+        char* path = malloc(strlen(dir_path) + strlen(child->string) + 2);
+        sprintf(path, "%s%s%s", dir_path, *dir_path ? "/" : "", child->string);
+
+        if (child->wemData) {
+            path[strlen(path) - strlen(".wem")] = '\0';
+            struct extracted_wem extracted_wem = {.extraction = extraction, .wem = child->wemData, .path = path, .file = -1};
+            add_object(&extraction->wems, &extracted_wem);
+            continue;
+        }
+        if (create_cached_dirs(dir_cache, path) == -1)
+            eprintf("Error: Failed to create directory \"%s\".\n", path);
+        else
+            collect_wems(extraction, dir_cache, child, path);
+        free(path);
+    }
+}
+
+static int write_wem_file(struct extraction* extraction, struct extracted_wem* extracted_wem)
+{
+    char path[strlen(extracted_wem->path) + sizeof(".wem")];
+    sprintf(path, "%s.wem", extracted_wem->path);
+    int file = openat(extraction->output_dir, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file == -1) {
+        eprintf("Error: Failed to open \"%s\".\n", path);
+        return -1;
+    }
+
+    AudioDataList* audio_data_list = extraction->audio_data_list;
+    AudioData* wem = extracted_wem->wem;
+    OutputSink output;
+    begin_file_output(&output, file);
+    uint8_t* data = acquire_audio_data(audio_data_list, wem);
+    if (data) {
+        append_output(&output, data, wem->length);
+        // like the converted wems, the written ones don't need to stay in memory
+        if (audio_data_list->source && !wem->owns_data)
+            release_mapped_range(audio_data_list->source, data, wem->length);
+        release_audio_data(audio_data_list, wem);
+    }
+    close(file);
+
+    return data && !output.failed ? 0 : -1;
+}
+
+static void* write_wem_files(void* argument)
+{
+    struct extraction* extraction = argument;
+
+    while (true) {
+        pthread_mutex_lock(&extraction->lock);
+        uint32_t i = extraction->next_wem++;
+        pthread_mutex_unlock(&extraction->lock);
+        if (i >= extraction->wems.length)
+            break;
+
+        if (write_wem_file(extraction, &extraction->wems.objects[i]) == -1) {
+            pthread_mutex_lock(&extraction->lock);
+            extraction->failed_count++;
+            pthread_mutex_unlock(&extraction->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static void write_wems_in_parallel(struct extraction* extraction, uint32_t thread_count)
+{
+    thread_count = min(thread_count, extraction->wems.length);
+    pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+    uint32_t started_count = 0;
+    for (uint32_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[started_count], NULL, write_wem_files, extraction) == 0)
+            started_count++;
+    }
+    // without any threads, the calling thread writes them all
+    if (started_count == 0)
+        write_wem_files(extraction);
+    for (uint32_t i = 0; i < started_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// called on the thread writing the converted wems only
+static int write_converted_piece(const uint8_t* data, uint64_t length, void* _extracted_wem)
+{
+    struct extracted_wem* extracted_wem = _extracted_wem;
+    if (extracted_wem->file == -1) {
+        // pcm wems are converted to wav
+        extracted_wem->extension = length >= 4 && memcmp(data, "RIFF", 4) == 0 ? ".wav" : ".ogg";
+        char path[strlen(extracted_wem->path) + sizeof(".ogg")];
+        sprintf(path, "%s%s", extracted_wem->path, extracted_wem->extension);
+        extracted_wem->file = openat(extracted_wem->extraction->output_dir, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (extracted_wem->file == -1) {
+            eprintf("Error: Failed to open \"%s\".\n", path);
+            return -1;
+        }
+        begin_file_output(&extracted_wem->file_output, extracted_wem->file);
+    }
+
+    append_output(&extracted_wem->file_output, data, length);
+    return extracted_wem->file_output.failed ? -1 : 0;
+}
+
+static bool open_converted_output(uint32_t index, AudioData* wem, OutputSink* output, void* _extraction)
+{
+    (void) wem;
+    struct extraction* extraction = _extraction;
+    begin_callback_output(output, write_converted_piece, &extraction->wems.objects[index]);
+    return true;
+}
+
+static void close_converted_output(uint32_t index, AudioData* wem, OutputSink* output, int status, void* _extraction)
+{
+    (void) wem;
+    (void) output;
+    struct extraction* extraction = _extraction;
+    struct extracted_wem* extracted_wem = &extraction->wems.objects[index];
+    if (status == -1)
+        extraction->failed_count++;
+    if (extracted_wem->file == -1)
+        return;
+
+    close(extracted_wem->file);
+    if (status == -1) { // a wem that fails to convert halfway through leaves nothing behind
+        char path[strlen(extracted_wem->path) + sizeof(".ogg")];
+        sprintf(path, "%s%s", extracted_wem->path, extracted_wem->extension);
+        unlinkat(extraction->output_dir, path, 0);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    // bnk_extract skips over the options that are only about writing the files
+    WemInformation* wem_information = bnk_extract(argc, argv);
+    if (!wem_information)
+        return argc >= 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    char* output_path = "output";
+    bool extract_wems = true;
+    bool extract_oggs = true;
+    uint32_t jobs = 0;
+    uint64_t memory_cap = 256;
+    for (char** arg = &argv[1]; *arg; arg++) {
+        if (strcmp(*arg, "-o") == 0 || strcmp(*arg, "--output") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                output_path = *arg;
+            }
+        } else if (strcmp(*arg, "--wems-only") == 0) {
+            extract_oggs = false;
+        } else if (strcmp(*arg, "--oggs-only") == 0) {
+            extract_wems = false;
+        } else if (strcmp(*arg, "-j") == 0 || strcmp(*arg, "--jobs") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                jobs = strtoul(*arg, NULL, 10);
+            }
+        } else if (strcmp(*arg, "--memory-cap") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                memory_cap = strtoull(*arg, NULL, 10);
+            }
+        }
+    }
+    if (jobs == 0)
+        jobs = get_cpu_count();
+
+    DirCache* working_dir_cache = open_dir_cache(AT_FDCWD);
+    int output_dir = create_cached_dirs(working_dir_cache, output_path) == -1 ? -1 : open(output_path, O_RDONLY | O_DIRECTORY);
+    close_dir_cache(working_dir_cache);
+    if (output_dir == -1) {
+        eprintf("Error: Failed to create output directory \"%s\".\n", output_path);
+        return EXIT_FAILURE;
+    }
+
+    struct extraction extraction = {.output_dir = output_dir, .audio_data_list = wem_information->sortedWemDataList};
+    pthread_mutex_init(&extraction.lock, NULL);
+    initialize_list(&extraction.wems);
+    DirCache* dir_cache = open_dir_cache(output_dir);
+    collect_wems(&extraction, dir_cache, wem_information->grouped_wems, "");
+    close_dir_cache(dir_cache);
+
+    if (extract_wems)
+        write_wems_in_parallel(&extraction, jobs);
+    if (extract_oggs) {
+        AudioData** wems = malloc(extraction.wems.length * sizeof(AudioData*));
+        for (uint32_t i = 0; i < extraction.wems.length; i++) {
+            wems[i] = extraction.wems.objects[i].wem;
+        }
+        stream_wems(extraction.audio_data_list, wems, extraction.wems.length, jobs, memory_cap * 1024 * 1024, open_converted_output, close_converted_output, &extraction);
+        free(wems);
+    }
+    v_printf(1, "Extracted %u files, %u of them failed.\n", extraction.wems.length * (extract_wems + extract_oggs), extraction.failed_count);
+
+    for (uint32_t i = 0; i < extraction.wems.length; i++) {
+        free(extraction.wems.objects[i].path);
+    }
+    free(extraction.wems.objects);
+    pthread_mutex_destroy(&extraction.lock);
+    close(output_dir);
+    free_audio_data_list(wem_information->sortedWemDataList);
+    free_wem_events(wem_information->wem_events);
+
+    return EXIT_SUCCESS;
+}
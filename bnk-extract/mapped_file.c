@@ -0,0 +1,112 @@
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mapped_file.h"
+
+MappedFile* map_file(const char* path)
+{
+    MappedFile* mapped_file = calloc(1, sizeof(MappedFile));
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        goto error;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        goto error;
+    }
+    mapped_file->length = file_size.QuadPart;
+    if (mapped_file->length != 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (!mapping)
+            goto error;
+        mapped_file->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping); // the view keeps the mapping object alive on its own
+        if (!mapped_file->data)
+            goto error;
+    } else {
+        CloseHandle(file);
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        goto error;
+    struct stat file_info;
+    if (fstat(fd, &file_info) == -1) {
+        close(fd);
+        goto error;
+    }
+    mapped_file->length = file_info.st_size;
+    if (mapped_file->length != 0) {
+        void* data = mmap(NULL, mapped_file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping stays valid after closing the descriptor
+        if (data == MAP_FAILED)
+            goto error;
+        mapped_file->data = data;
+    } else {
+        close(fd);
+    }
+#endif
+
+    return mapped_file;
+
+    error:
+    free(mapped_file);
+    return NULL;
+}
+
+void unmap_file(MappedFile* mapped_file)
+{
+    if (!mapped_file)
+        return;
+
+    if (mapped_file->data) {
+#ifdef _WIN32
+        UnmapViewOfFile(mapped_file->data);
+#else
+        munmap(mapped_file->data, mapped_file->length);
+#endif
+    }
+    free(mapped_file);
+}
+
+void prefetch_mapped_range(const MappedFile* mapped_file, const uint8_t* data, uint64_t length)
+{
+#ifndef _WIN32
+    // the partial pages at both ends get read along with the others anyways
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uint8_t* begin = (uint8_t*) ((uintptr_t) data & ~(page_size - 1));
+    if (mapped_file->data && length > 0)
+        madvise(begin, data + length - begin, MADV_WILLNEED);
+#else
+    (void) mapped_file;
+    (void) data;
+    (void) length;
+#endif
+}
+
+void release_mapped_range(const MappedFile* mapped_file, const uint8_t* data, uint64_t length)
+{
+#ifndef _WIN32
+    // the partial pages at both ends may still be needed for the data next to the range
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t) data + page_size - 1) & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t) data + length) & ~(page_size - 1);
+    if (mapped_file->data && end > begin)
+        madvise((void*) begin, end - begin, MADV_DONTNEED);
+#else
+    (void) mapped_file;
+    (void) data;
+    (void) length;
+#endif
+}
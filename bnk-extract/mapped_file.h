@@ -0,0 +1,31 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// read-only view of a whole file. data is NULL for empty files.
+typedef struct mapped_file {
+    uint64_t length;
+    uint8_t* data;
+} MappedFile;
+
+MappedFile* map_file(const char* path);
+
+void unmap_file(MappedFile* mapped_file);
+
+// hints that the length bytes at data are about to be read, so that reading them from disk starts right away
+void prefetch_mapped_range(const MappedFile* mapped_file, const uint8_t* data, uint64_t length);
+
+// drops the pages that lie fully within the length bytes at data from memory, they are read from the file again once used.
+// Both are only hints, they do nothing on windows.
+void release_mapped_range(const MappedFile* mapped_file, const uint8_t* data, uint64_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
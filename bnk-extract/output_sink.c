@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "output_sink.h"
+#include "gnu_minmax.h"
+
+static void reserve_output(OutputSink* sink, uint64_t allocated_length)
+{
+    if (allocated_length <= sink->allocated_length)
+        return;
+    sink->data = realloc(sink->data, allocated_length);
+    sink->allocated_length = allocated_length;
+}
+
+void begin_output(OutputSink* sink, BinaryData* output, uint64_t expected_length)
+{
+    *sink = (OutputSink) {
+        .type = OUTPUT_TO_MEMORY,
+        .length = output->length,
+        .allocated_length = output->length,
+        .data = output->data
+    };
+    reserve_output(sink, output->length + expected_length);
+}
+
+void begin_file_output(OutputSink* sink, int file_descriptor)
+{
+    *sink = (OutputSink) {
+        .type = OUTPUT_TO_FILE,
+        .file_descriptor = file_descriptor
+    };
+}
+
+void begin_callback_output(OutputSink* sink, OutputCallback function, void* user_data)
+{
+    *sink = (OutputSink) {
+        .type = OUTPUT_TO_CALLBACK,
+        .callback = function,
+        .user_data = user_data
+    };
+}
+
+static int write_all(int file_descriptor, const uint8_t* data, uint64_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(file_descriptor, data, min(length, (uint64_t) 1 << 30));
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+void append_output(OutputSink* sink, const void* data, uint64_t length)
+{
+    // once something is missing, nothing after it is of use either
+    if (sink->failed || length == 0)
+        return;
+
+    switch (sink->type) {
+        case OUTPUT_TO_MEMORY:
+            if (sink->allocated_length - sink->length < length)
+                reserve_output(sink, max(sink->length + length, sink->allocated_length * 2));
+            memcpy(&sink->data[sink->length], data, length);
+            break;
+        case OUTPUT_TO_FILE:
+            sink->failed = write_all(sink->file_descriptor, data, length) == -1;
+            break;
+        case OUTPUT_TO_CALLBACK:
+            sink->failed = sink->callback(data, length, sink->user_data) == -1;
+            break;
+    }
+    sink->length += length;
+}
+
+bool rewind_output(OutputSink* sink, uint64_t length)
+{
+    if (sink->type != OUTPUT_TO_MEMORY)
+        return false;
+
+    sink->length = min(sink->length, length);
+    return true;
+}
+
+void end_output(OutputSink* sink, BinaryData* output)
+{
+    // shrinking costs a copy, so only done if a lot of room was left over, like after doubling
+    if (sink->allocated_length - sink->length > sink->length / 4 && sink->length != 0) {
+        sink->data = realloc(sink->data, sink->length);
+        sink->allocated_length = sink->length;
+    }
+    output->length = sink->length;
+    output->data = sink->data;
+}
@@ -0,0 +1,59 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "defs.h"
+
+// gets the output in pieces as it is produced, returns -1 if it could not be written
+typedef int (*OutputCallback)(const uint8_t* data, uint64_t length, void* user_data);
+
+enum output_sink_type {
+    OUTPUT_TO_MEMORY,
+    OUTPUT_TO_FILE,
+    OUTPUT_TO_CALLBACK
+};
+
+// where converted data gets written to, as it is produced
+typedef struct output_sink {
+    enum output_sink_type type;
+    uint64_t length; // bytes written so far
+    bool failed; // set once a write failed, the output is incomplete then
+
+    // OUTPUT_TO_MEMORY, grows by doubling so that appending many small pieces stays linear
+    uint64_t allocated_length;
+    uint8_t* data;
+
+    // OUTPUT_TO_FILE
+    int file_descriptor;
+
+    // OUTPUT_TO_CALLBACK
+    OutputCallback callback;
+    void* user_data;
+} OutputSink;
+
+// takes over the data of output, with room for expected_length more bytes
+void begin_output(OutputSink* sink, BinaryData* output, uint64_t expected_length);
+
+// the descriptor stays open, it is up to the caller to close it
+void begin_file_output(OutputSink* sink, int file_descriptor);
+
+void begin_callback_output(OutputSink* sink, OutputCallback function, void* user_data);
+
+void append_output(OutputSink* sink, const void* data, uint64_t length);
+
+// drops everything written after the first length bytes. Only possible for memory sinks, returns false for the others.
+bool rewind_output(OutputSink* sink, uint64_t length);
+
+// hands the data of a memory sink back to output, without most of the unused room
+void end_output(OutputSink* sink, BinaryData* output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,3 +1,25 @@
+#ifndef REVORB_API_H
+#define REVORB_API_H
+
 #include "../defs.h"
+#include "../output_sink.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// recomputes the granule positions of the ogg in input and appends the result to output.
+// Returns -1 if the vorbis headers could not be read, output may still have been written to then.
+int revorb_convert(const BinaryData* input, BinaryData* output);
 
+// the same, writing the pages to output as they are made
+int revorb_convert_to_sink(const BinaryData* input, OutputSink* output);
+
+// call like a main(), argv[1] is the hex pointer to a BinaryData
 BinaryData* revorb(int argc, const char** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -35,12 +35,14 @@
 #include <vorbis/codec.h>
 #include "../defs.h"
 #include "../general_utils.h"
-#include "../list.h"
+#include "../gnu_minmax.h"
+#include "../output_sink.h"
+#include "api.h"
 
 bool g_failed;
 
-uint32_t copy_headers(BinaryData* file_data, ogg_sync_state *si, ogg_stream_state *is,
-                      uint8_list* lo, ogg_stream_state *os, vorbis_info *vi)
+uint32_t copy_headers(const BinaryData* file_data, ogg_sync_state *si, ogg_stream_state *is,
+                      OutputSink* lo, ogg_stream_state *os, vorbis_info *vi)
 {
     char *buffer = ogg_sync_buffer(si, 4096);
     uint32_t numread = min(file_data->length, 4096u);
@@ -126,8 +128,8 @@ uint32_t copy_headers(BinaryData* file_data, ogg_sync_state *si, ogg_stream_stat
     vorbis_comment_clear(&vc);
 
     while(ogg_stream_flush(os,&page)) {
-        add_objects(lo, page.header, (uint32_t) page.header_len);
-        add_objects(lo, page.body, (uint32_t) page.body_len);
+        append_output(lo, page.header, page.header_len);
+        append_output(lo, page.body, page.body_len);
         // if (fwrite(page.header, 1, page.header_len, fo) != (size_t) page.header_len || fwrite(page.body, 1, page.body_len, fo) != (size_t) page.body_len) {
             // fprintf(stderr,"Cannot write headers to output.\n");
             // ogg_stream_clear(is);
@@ -139,18 +141,9 @@ uint32_t copy_headers(BinaryData* file_data, ogg_sync_state *si, ogg_stream_stat
     return file_pos;
 }
 
-BinaryData* revorb(int argc, const char **argv)
+int revorb_convert_to_sink(const BinaryData* file_data, OutputSink* output)
 {
-    if (argc < 2) {
-        eprintf("-= REVORB - <yirkha@fud.cz> 2008/06/29 =-\n");
-        eprintf("Recomputes page granule positions in Ogg Vorbis files.\n");
-        eprintf("Usage:\n");
-        eprintf("  revorb <input.ogg> [output.ogg]\n");
-        return NULL;
-    }
-
-    uint8_list output_buffer;
-    initialize_list(&output_buffer);
+    bool headers_copied = false;
 
   ogg_sync_state sync_in;
   ogg_sync_init(&sync_in);
@@ -162,10 +155,9 @@ BinaryData* revorb(int argc, const char **argv)
   ogg_packet packet;
   ogg_page page;
 
-  BinaryData* file_data;
-  hex2bytes(argv[1], &file_data, 16);
   uint32_t file_pos;
-  if ( (file_pos = copy_headers(file_data, &sync_in, &stream_in, &output_buffer, &stream_out, &vi)) ) {
+  if ( (file_pos = copy_headers(file_data, &sync_in, &stream_in, output, &stream_out, &vi)) ) {
+      headers_copied = true;
       ogg_int64_t granpos = 0, packetnum = 0;
       int lastbs = 0;
 
@@ -222,8 +214,8 @@ BinaryData* revorb(int argc, const char **argv)
 
               ogg_page opage;
               while(ogg_stream_pageout(&stream_out, &opage)) {
-                add_objects(&output_buffer, opage.header, (uint32_t) opage.header_len);
-                add_objects(&output_buffer, opage.body, (uint32_t) opage.body_len);
+                append_output(output, opage.header, opage.header_len);
+                append_output(output, opage.body, opage.body_len);
                 // if (fwrite(opage.header, 1, opage.header_len, fo) != (size_t) opage.header_len || fwrite(opage.body, 1, opage.body_len, fo) != (size_t) opage.body_len) {
                   // eprintf("Unable to write page to output.\n");
                   // eos = 2;
@@ -244,8 +236,8 @@ BinaryData* revorb(int argc, const char **argv)
         ogg_stream_packetin(&stream_out, &packet);
         ogg_page opage;
         while(ogg_stream_flush(&stream_out, &opage)) {
-          add_objects(&output_buffer, opage.header, (uint32_t) opage.header_len);
-          add_objects(&output_buffer, opage.body, (uint32_t) opage.body_len);
+          append_output(output, opage.header, opage.header_len);
+          append_output(output, opage.body, opage.body_len);
           // if (fwrite(opage.header, 1, opage.header_len, fo) != (size_t) opage.header_len || fwrite(opage.body, 1, opage.body_len, fo) != (size_t) opage.body_len) {
             // eprintf("Unable to write page to output.\n");
             // g_failed = true;
@@ -268,9 +260,34 @@ BinaryData* revorb(int argc, const char **argv)
 
   // fclose(fo);
 
-  BinaryData* converted_ogg_data = malloc(sizeof(BinaryData));
-  converted_ogg_data->data = output_buffer.objects;
-  converted_ogg_data->length = output_buffer.length;
+  return headers_copied ? 0 : -1;
+}
+
+int revorb_convert(const BinaryData* file_data, BinaryData* output)
+{
+    // the granules are all that changes, so the ogg stays about as large
+    OutputSink sink;
+    begin_output(&sink, output, file_data->length);
+    int status = revorb_convert_to_sink(file_data, &sink);
+    end_output(&sink, output);
+
+    return status;
+}
+
+BinaryData* revorb(int argc, const char **argv)
+{
+    if (argc < 2) {
+        eprintf("-= REVORB - <yirkha@fud.cz> 2008/06/29 =-\n");
+        eprintf("Recomputes page granule positions in Ogg Vorbis files.\n");
+        eprintf("Usage:\n");
+        eprintf("  revorb <input.ogg> [output.ogg]\n");
+        return NULL;
+    }
+
+    BinaryData* file_data;
+    hex2bytes(argv[1], &file_data, 16);
+    BinaryData* converted_ogg_data = calloc(1, sizeof(BinaryData));
+    revorb_convert(file_data, converted_ogg_data);
 
-  return converted_ogg_data;
+    return converted_ogg_data;
 }
@@ -1,12 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <assert.h>
+#include <stdbool.h>
+#include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "defs.h"
 #include "bin.h"
 #include "bnk.h"
+#include "general_utils.h"
+#include "id_index.h"
+#include "mapped_file.h"
 #include "wpk.h"
 
 int VERBOSE = 0;
@@ -68,6 +73,36 @@ typedef LIST(struct event_action) EventActionSection;
 typedef LIST(struct event) EventSection;
 typedef LIST(struct random_container) RandomContainerSection;
 
+// location of one HIRC object's data inside the mapped bank
+struct hirc_object {
+    uint64_t position;
+    uint32_t length;
+    uint8_t type;
+};
+typedef LIST(struct hirc_object) HircObjectList;
+
+struct hirc_sections {
+    SoundSection sounds;
+    EventActionSection event_actions;
+    EventSection events;
+    RandomContainerSection random_containers;
+    MusicContainerSection music_segments;
+    MusicTrackSection music_tracks;
+    MusicContainerSection music_playlists;
+};
+
+// a range of HIRC objects, decoded on its own thread into its own sections
+struct hirc_chunk {
+    const MappedFile* bnk_file;
+    const struct hirc_object* objects;
+    uint32_t object_count;
+    uint32_t bnk_version;
+    struct hirc_sections sections;
+};
+
+// banks are only decoded on multiple threads with at least this many objects per thread
+#define MIN_OBJECTS_PER_THREAD 4096
+
 
 void free_sound_section(SoundSection* section)
 {
@@ -108,162 +143,233 @@ void free_music_track_section(MusicTrackSection* section)
     free(section->objects);
 }
 
-int read_random_container_object(FILE* bnk_file, RandomContainerSection* random_containers, uint32_t bnk_version)
+// bounds-checked reader over one in-memory HIRC object. Reading past its end yields zeros and sets overrun.
+struct cursor {
+    const uint8_t* data;
+    uint64_t position;
+    uint64_t end;
+    bool overrun;
+};
+
+static bool has_bytes(struct cursor* cursor, uint64_t amount)
+{
+    if (cursor->overrun || amount > cursor->end - cursor->position)
+        cursor->overrun = true;
+    return !cursor->overrun;
+}
+
+static void skip_bytes(struct cursor* cursor, uint64_t amount)
+{
+    if (has_bytes(cursor, amount))
+        cursor->position += amount;
+}
+
+static void read_bytes(struct cursor* cursor, void* output, uint64_t amount)
+{
+    if (has_bytes(cursor, amount)) {
+        memcpy(output, &cursor->data[cursor->position], amount);
+        cursor->position += amount;
+    } else {
+        memset(output, 0, amount);
+    }
+}
+
+static uint8_t read_u8(struct cursor* cursor)
+{
+    uint8_t value;
+    read_bytes(cursor, &value, 1);
+    return value;
+}
+
+static uint16_t read_u16(struct cursor* cursor)
+{
+    uint16_t value;
+    read_bytes(cursor, &value, 2);
+    return value;
+}
+
+static uint32_t read_u32(struct cursor* cursor)
+{
+    uint32_t value;
+    read_bytes(cursor, &value, 4);
+    return value;
+}
+
+// returns NULL (and sets overrun) if the object is too short to hold amount ids
+static uint32_t* read_u32_array(struct cursor* cursor, uint32_t amount)
+{
+    if (!has_bytes(cursor, amount * 4ull))
+        return NULL;
+    // never NULL for an empty array, which would look like an overrun
+    uint32_t* values = malloc(amount ? amount * 4ull : 1);
+    read_bytes(cursor, values, amount * 4ull);
+
+    return values;
+}
+
+int read_random_container_object(struct cursor* cursor, RandomContainerSection* random_containers, uint32_t bnk_version)
 {
     struct random_container new_random_container_object;
-    assert(fread(&new_random_container_object.self_id, 4, 1, bnk_file) == 1);
-    dprintf("at the beginning: %ld\n", ftell(bnk_file));
-    fseek(bnk_file, 1, SEEK_CUR);
-    uint8_t num_fx = getc(bnk_file);
-    fseek(bnk_file, 5 + (num_fx != 0) - (bnk_version <= 0x59) + (num_fx * 7), SEEK_CUR);
-    dprintf("reading in switch container id at position %ld\n", ftell(bnk_file));
-    assert(fread(&new_random_container_object.switch_container_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, (bnk_version <= 0x59 ? 2 : 1), SEEK_CUR);
-    uint8_t prop_count = getc(bnk_file);
-    fseek(bnk_file, 5 * prop_count, SEEK_CUR);
-    prop_count = getc(bnk_file);
-    fseek(bnk_file, 9 * prop_count, SEEK_CUR);
-    uint8_t positioning_bits = getc(bnk_file);
+    new_random_container_object.self_id = read_u32(cursor);
+    dprintf("at the beginning: %" PRIu64 "\n", cursor->position);
+    skip_bytes(cursor, 1);
+    uint8_t num_fx = read_u8(cursor);
+    skip_bytes(cursor, 5 + (num_fx != 0) - (bnk_version <= 0x59) + (num_fx * 7));
+    dprintf("reading in switch container id at position %" PRIu64 "\n", cursor->position);
+    new_random_container_object.switch_container_id = read_u32(cursor);
+    skip_bytes(cursor, (bnk_version <= 0x59 ? 2 : 1));
+    uint8_t prop_count = read_u8(cursor);
+    skip_bytes(cursor, 5 * prop_count);
+    prop_count = read_u8(cursor);
+    skip_bytes(cursor, 9 * prop_count);
+    uint8_t positioning_bits = read_u8(cursor);
     bool has_positioning = positioning_bits & 1, has_3d = false, has_automation = false;
     if (has_positioning) {
         if (bnk_version <= 0x59) {
-            bool has_2d = getc(bnk_file);
-            has_3d = getc(bnk_file);
-            if (has_2d) getc(bnk_file);
+            bool has_2d = read_u8(cursor);
+            has_3d = read_u8(cursor);
+            if (has_2d) skip_bytes(cursor, 1);
         } else {
             has_3d = positioning_bits & 0x2;
         }
     }
     if (has_positioning && has_3d) {
         if (bnk_version <= 0x59) {
-            has_automation = (getc(bnk_file) & 3) != 1;
-            fseek(bnk_file, 8, SEEK_CUR);
+            has_automation = (read_u8(cursor) & 3) != 1;
+            skip_bytes(cursor, 8);
         } else {
             has_automation = (positioning_bits >> 5) & 3;
-            getc(bnk_file);
+            skip_bytes(cursor, 1);
         }
     }
     if (has_automation) {
-        fseek(bnk_file, (bnk_version <= 0x59 ? 9 : 5), SEEK_CUR);
-        uint32_t num_vertices;
-        assert(fread(&num_vertices, 4, 1, bnk_file) == 1);
-        fseek(bnk_file, 16 * num_vertices, SEEK_CUR);
-        uint32_t num_playlist_items;
-        assert(fread(&num_playlist_items, 4, 1, bnk_file) == 1);
-        dprintf("num vertices: %d, prop count: %d, num_playlist items: %d, ftell: %ld\n", num_vertices, prop_count, num_playlist_items, ftell(bnk_file));
-        fseek(bnk_file, (bnk_version <= 0x59 ? 16 : 20) * num_playlist_items, SEEK_CUR);
+        skip_bytes(cursor, (bnk_version <= 0x59 ? 9 : 5));
+        uint32_t num_vertices = read_u32(cursor);
+        skip_bytes(cursor, 16ull * num_vertices);
+        uint32_t num_playlist_items = read_u32(cursor);
+        dprintf("num vertices: %d, prop count: %d, num_playlist items: %d, position: %" PRIu64 "\n", num_vertices, prop_count, num_playlist_items, cursor->position);
+        skip_bytes(cursor, (bnk_version <= 0x59 ? 16ull : 20ull) * num_playlist_items);
     } else if (bnk_version <= 0x59) {
-        getc(bnk_file);
+        skip_bytes(cursor, 1);
     }
-    fseek(bnk_file, 9, SEEK_CUR);
-    uint16_t num_rtpc;
-    assert(fread(&num_rtpc, 2, 1, bnk_file) == 1);
+    skip_bytes(cursor, 9);
+    uint16_t num_rtpc = read_u16(cursor);
     for (int i = 0; i < num_rtpc; i++) {
-        fseek(bnk_file, 12, SEEK_CUR);
-        uint16_t point_count;
-        assert(fread(&point_count, 2, 1, bnk_file) == 1);
-        fseek(bnk_file, 12 * point_count, SEEK_CUR);
+        skip_bytes(cursor, 12);
+        uint16_t point_count = read_u16(cursor);
+        skip_bytes(cursor, 12 * point_count);
     }
-    fseek(bnk_file, 24, SEEK_CUR);
-    assert(fread(&new_random_container_object.sound_id_amount, 4, 1, bnk_file) == 1);
+    skip_bytes(cursor, 24);
+    new_random_container_object.sound_id_amount = read_u32(cursor);
     dprintf("sound object id amount: %u\n", new_random_container_object.sound_id_amount);
+    if (cursor->overrun)
+        return -1;
     if (new_random_container_object.sound_id_amount > 100) {
         eprintf("Would have allocated %u bytes. That can't be right. (ERROR btw)\n", new_random_container_object.sound_id_amount * 4);
         return -1;
     }
-    new_random_container_object.sound_ids = malloc(new_random_container_object.sound_id_amount * 4);
-    assert(fread(new_random_container_object.sound_ids, 4, new_random_container_object.sound_id_amount, bnk_file) == new_random_container_object.sound_id_amount);
+    new_random_container_object.sound_ids = read_u32_array(cursor, new_random_container_object.sound_id_amount);
+    if (!new_random_container_object.sound_ids)
+        return -1;
 
     add_object(random_containers, &new_random_container_object);
 
     return 0;
 }
 
-int read_sound_object(FILE* bnk_file, SoundSection* sounds, uint32_t bnk_version)
+int read_sound_object(struct cursor* cursor, SoundSection* sounds, uint32_t bnk_version)
 {
     struct sound new_sound_object;
-    assert(fread(&new_sound_object.self_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, 4, SEEK_CUR);
-    assert(fread(&new_sound_object.is_streamed, 1, 1, bnk_file) == 1);
-    if (bnk_version == 0x58) fseek(bnk_file, 3, SEEK_CUR); // was 4 byte field with 3 bytes zero
-    assert(fread(&new_sound_object.file_id, 4, 1, bnk_file) == 1);
-    assert(fread(&new_sound_object.source_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, 8 - (bnk_version == 0x58), SEEK_CUR);
-    assert(fread(&new_sound_object.sound_object_id, 4, 1, bnk_file) == 1);
+    new_sound_object.self_id = read_u32(cursor);
+    skip_bytes(cursor, 4);
+    new_sound_object.is_streamed = read_u8(cursor);
+    if (bnk_version == 0x58) skip_bytes(cursor, 3); // was 4 byte field with 3 bytes zero
+    new_sound_object.file_id = read_u32(cursor);
+    new_sound_object.source_id = read_u32(cursor);
+    skip_bytes(cursor, 8 - (bnk_version == 0x58));
+    new_sound_object.sound_object_id = read_u32(cursor);
+    if (cursor->overrun)
+        return -1;
 
     add_object(sounds, &new_sound_object);
 
     return 0;
 }
 
-int read_event_action_object(FILE* bnk_file, EventActionSection* event_actions)
+int read_event_action_object(struct cursor* cursor, EventActionSection* event_actions)
 {
     struct event_action new_event_action_object;
-    assert(fread(&new_event_action_object.self_id, 4, 1, bnk_file) == 1);
-    assert(fread(&new_event_action_object.scope, 1, 1, bnk_file) == 1);
-    assert(fread(&new_event_action_object.type, 1, 1, bnk_file) == 1);
+    new_event_action_object.self_id = read_u32(cursor);
+    new_event_action_object.scope = read_u8(cursor);
+    new_event_action_object.type = read_u8(cursor);
     if (new_event_action_object.type == 25) {
-        fseek(bnk_file, 7, SEEK_CUR);
-        assert(fread(&new_event_action_object.switch_group_id, 4, 1, bnk_file) == 1);
+        skip_bytes(cursor, 7);
+        new_event_action_object.switch_group_id = read_u32(cursor);
     } else {
-        assert(fread(&new_event_action_object.sound_object_id, 4, 1, bnk_file) == 1);
+        new_event_action_object.sound_object_id = read_u32(cursor);
     }
+    if (cursor->overrun)
+        return -1;
 
     add_object(event_actions, &new_event_action_object);
 
     return 0;
 }
 
-int read_event_object(FILE* bnk_file, EventSection* events, uint32_t bnk_version)
+int read_event_object(struct cursor* cursor, EventSection* events, uint32_t bnk_version)
 {
     struct event new_event_object;
-    assert(fread(&new_event_object.self_id, 4, 1, bnk_file) == 1);
-    assert(fread(&new_event_object.event_amount, 1, 1, bnk_file) == 1);
-    if (bnk_version == 0x58) fseek(bnk_file, 3, SEEK_CUR); // presumably padding bytes or 4 byte int which was later deemed unnecessarily high
-    new_event_object.event_ids = malloc(new_event_object.event_amount * 4);
-    assert(fread(new_event_object.event_ids, 4, new_event_object.event_amount, bnk_file) == new_event_object.event_amount);
+    new_event_object.self_id = read_u32(cursor);
+    new_event_object.event_amount = read_u8(cursor);
+    if (bnk_version == 0x58) skip_bytes(cursor, 3); // presumably padding bytes or 4 byte int which was later deemed unnecessarily high
+    new_event_object.event_ids = read_u32_array(cursor, new_event_object.event_amount);
+    if (!new_event_object.event_ids)
+        return -1;
 
     add_object(events, &new_event_object);
 
     return 0;
 }
 
-int read_music_container_object(FILE* bnk_file, MusicContainerSection* music_containers)
+int read_music_container_object(struct cursor* cursor, MusicContainerSection* music_containers)
 {
     struct music_container new_music_container_object;
-    assert(fread(&new_music_container_object.self_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, 4, SEEK_CUR);
-    assert(fread(&new_music_container_object.music_switch_id, 4, 1, bnk_file) == 1);
-    assert(fread(&new_music_container_object.sound_object_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, 1, SEEK_CUR);
-    fseek(bnk_file, 5 * getc(bnk_file), SEEK_CUR);
-    fseek(bnk_file, 9 * getc(bnk_file), SEEK_CUR);
-    fseek(bnk_file, 9 + (getc(bnk_file) > 1), SEEK_CUR);
-    uint8_t unk = getc(bnk_file);
+    new_music_container_object.self_id = read_u32(cursor);
+    skip_bytes(cursor, 4);
+    new_music_container_object.music_switch_id = read_u32(cursor);
+    new_music_container_object.sound_object_id = read_u32(cursor);
+    skip_bytes(cursor, 1);
+    skip_bytes(cursor, 5 * read_u8(cursor));
+    skip_bytes(cursor, 9 * read_u8(cursor));
+    skip_bytes(cursor, 9 + (read_u8(cursor) > 1));
+    uint8_t unk = read_u8(cursor);
     int to_seek = 1;
     if (unk == 2) {
         to_seek++;
-        fseek(bnk_file, 16, SEEK_CUR);
-        fseek(bnk_file, 8 * getc(bnk_file), SEEK_CUR);
+        skip_bytes(cursor, 16);
+        skip_bytes(cursor, 8 * read_u8(cursor));
     }
-    fseek(bnk_file, to_seek, SEEK_CUR);
-    assert(fread(&new_music_container_object.music_track_id_amount, 4, 1, bnk_file) == 1);
-    new_music_container_object.music_track_ids = malloc(new_music_container_object.music_track_id_amount * 4);
-    assert(fread(new_music_container_object.music_track_ids, 4, new_music_container_object.music_track_id_amount, bnk_file) == new_music_container_object.music_track_id_amount);
+    skip_bytes(cursor, to_seek);
+    new_music_container_object.music_track_id_amount = read_u32(cursor);
+    new_music_container_object.music_track_ids = read_u32_array(cursor, new_music_container_object.music_track_id_amount);
+    if (!new_music_container_object.music_track_ids)
+        return -1;
 
     add_object(music_containers, &new_music_container_object);
 
     return 0;
 }
 
-int read_music_track_object(FILE* bnk_file, MusicTrackSection* music_tracks)
+int read_music_track_object(struct cursor* cursor, MusicTrackSection* music_tracks)
 {
     struct music_track new_music_track_object;
-    assert(fread(&new_music_track_object.self_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, 10, SEEK_CUR);
-    assert(fread(&new_music_track_object.file_id, 4, 1, bnk_file) == 1);
-    fseek(bnk_file, 64, SEEK_CUR);
-    assert(fread(&new_music_track_object.music_container_id, 4, 1, bnk_file) == 1);
+    new_music_track_object.self_id = read_u32(cursor);
+    skip_bytes(cursor, 10);
+    new_music_track_object.file_id = read_u32(cursor);
+    skip_bytes(cursor, 64);
+    new_music_track_object.music_container_id = read_u32(cursor);
+    if (cursor->overrun)
+        return -1;
 
     add_object(music_tracks, &new_music_track_object);
 
@@ -271,76 +377,171 @@ int read_music_track_object(FILE* bnk_file, MusicTrackSection* music_tracks)
 }
 
 
-int parse_event_bnk_file(char* path, SoundSection* sounds, EventActionSection* event_actions, EventSection* events, RandomContainerSection* random_containers, MusicContainerSection* music_segments, MusicTrackSection* music_tracks, MusicContainerSection* music_playlists)
+static void* decode_hirc_objects(void* argument)
 {
-    FILE* bnk_file = fopen(path, "rb");
-    if (!bnk_file) {
-        eprintf("Error: Failed to open \"%s\".\n", path);
-        return -1;
-    }
-    char magic[4];
-    assert(fread(magic, 1, 4, bnk_file) == 4);
-    if (memcmp(magic, "BKHD", 4) != 0) {
-        eprintf("Error: Not a bnk file!\n");
-        fclose(bnk_file);
-        return -1;
-    }
-    fseek(bnk_file, 4, SEEK_CUR);
-    uint32_t bnk_version;
-    assert(fread(&bnk_version, 4, 1, bnk_file) == 1);
-
-    uint32_t section_length = skip_to_section(bnk_file, "HIRC", true);
-    if (!section_length) {
-        eprintf("Error: Failed to skip to section \"HIRC\" in file \"%s\".\nMake sure to provide the correct file.\n", path);
-        fclose(bnk_file);
-        return -1;
-    }
-    uint32_t initial_position = ftell(bnk_file);
-    uint32_t num_of_objects;
-    assert(fread(&num_of_objects, 4, 1, bnk_file) == 1);
-    uint32_t objects_read = 0;
-    while ((uint32_t) ftell(bnk_file) < initial_position + section_length) {
-        uint8_t type;
-        uint32_t object_length;
-        assert(fread(&type, 1, 1, bnk_file) == 1);
-        assert(fread(&object_length, 4, 1, bnk_file) == 1);
-
-        dprintf("Am here with an object of type %u\n", type);
-        int object_start = ftell(bnk_file);
-        switch (type)
+    struct hirc_chunk* chunk = argument;
+    struct hirc_sections* sections = &chunk->sections;
+    for (uint32_t i = 0; i < chunk->object_count; i++) {
+        const struct hirc_object* object = &chunk->objects[i];
+        dprintf("Am here with an object of type %u\n", object->type);
+        struct cursor cursor = {.data = chunk->bnk_file->data, .position = object->position, .end = object->position + object->length};
+        switch (object->type)
         {
             case 2:
-                read_sound_object(bnk_file, sounds, bnk_version);
+                read_sound_object(&cursor, &sections->sounds, chunk->bnk_version);
                 break;
             case 3:
-                read_event_action_object(bnk_file, event_actions);
+                read_event_action_object(&cursor, &sections->event_actions);
                 break;
             case 4:
-                read_event_object(bnk_file, events, bnk_version);
+                read_event_object(&cursor, &sections->events, chunk->bnk_version);
                 break;
             case 5:
-                read_random_container_object(bnk_file, random_containers, bnk_version);
+                read_random_container_object(&cursor, &sections->random_containers, chunk->bnk_version);
                 break;
             case 10:
-                read_music_container_object(bnk_file, music_segments);
+                read_music_container_object(&cursor, &sections->music_segments);
                 break;
             case 11:
-                read_music_track_object(bnk_file, music_tracks);
+                read_music_track_object(&cursor, &sections->music_tracks);
                 break;
             case 13:
-                read_music_container_object(bnk_file, music_playlists);
+                read_music_container_object(&cursor, &sections->music_playlists);
                 break;
             default:
                 dprintf("Skipping object, as it is irrelevant for me.\n");
-                dprintf("gonna seek %u forward\n", object_length);
+                dprintf("gonna seek %u forward\n", object->length);
         }
-        fseek(bnk_file, object_start + object_length, SEEK_SET);
+        if (cursor.overrun)
+            v_printf(1, "Skipped object of type %u at offset %" PRIu64 ", as it is shorter than expected.\n", object->type, object->position - 5);
+    }
 
-        objects_read++;
+    return NULL;
+}
+
+static void initialize_sections(struct hirc_sections* sections)
+{
+    initialize_list(&sections->sounds);
+    initialize_list(&sections->event_actions);
+    initialize_list(&sections->events);
+    initialize_list(&sections->random_containers);
+    initialize_list(&sections->music_segments);
+    initialize_list(&sections->music_tracks);
+    initialize_list(&sections->music_playlists);
+}
+
+// moves all objects of source to the end of destination and frees source's lists
+static void append_sections(struct hirc_sections* destination, struct hirc_sections* source)
+{
+    add_objects(&destination->sounds, source->sounds.objects, source->sounds.length);
+    add_objects(&destination->event_actions, source->event_actions.objects, source->event_actions.length);
+    add_objects(&destination->events, source->events.objects, source->events.length);
+    add_objects(&destination->random_containers, source->random_containers.objects, source->random_containers.length);
+    add_objects(&destination->music_segments, source->music_segments.objects, source->music_segments.length);
+    add_objects(&destination->music_tracks, source->music_tracks.objects, source->music_tracks.length);
+    add_objects(&destination->music_playlists, source->music_playlists.objects, source->music_playlists.length);
+    free(source->sounds.objects);
+    free(source->event_actions.objects);
+    free(source->events.objects);
+    free(source->random_containers.objects);
+    free(source->music_segments.objects);
+    free(source->music_tracks.objects);
+    free(source->music_playlists.objects);
+}
+
+// Large banks are decoded in two passes: the first one only collects where each object starts (every object is prefixed by type and length),
+// the second one decodes consecutive ranges of objects on multiple threads. Appending the ranges in order gives the same lists a single thread would have produced.
+int parse_event_bnk_file(char* path, SoundSection* sounds, EventActionSection* event_actions, EventSection* events, RandomContainerSection* random_containers, MusicContainerSection* music_segments, MusicTrackSection* music_tracks, MusicContainerSection* music_playlists)
+{
+    MappedFile* bnk_file = map_file(path);
+    if (!bnk_file) {
+        eprintf("Error: Failed to open \"%s\".\n", path);
+        return -1;
+    }
+    if (bnk_file->length < 12 || memcmp(bnk_file->data, "BKHD", 4) != 0) {
+        eprintf("Error: Not a bnk file!\n");
+        unmap_file(bnk_file);
+        return -1;
     }
-    dprintf("objects read: %u, num of objects: %u\n", objects_read, num_of_objects);
-    assert(objects_read == num_of_objects);
-    dprintf("Current offset: %ld\n", ftell(bnk_file));
+    uint32_t bnk_version;
+    memcpy(&bnk_version, &bnk_file->data[8], 4);
+
+    uint64_t hirc_position = 0;
+    uint32_t section_length = skip_to_section(bnk_file, &hirc_position, "HIRC");
+    if (section_length < 4) {
+        eprintf("Error: Failed to skip to section \"HIRC\" in file \"%s\".\nMake sure to provide the correct file.\n", path);
+        unmap_file(bnk_file);
+        return -1;
+    }
+
+    uint64_t section_end = hirc_position + section_length;
+    uint32_t num_of_objects;
+    memcpy(&num_of_objects, &bnk_file->data[hirc_position], 4);
+    uint64_t position = hirc_position + 4;
+    HircObjectList objects;
+    initialize_list(&objects);
+    while (position < section_end) {
+        if (section_end - position < 5) {
+            eprintf("Error: HIRC section of \"%s\" is truncated.\n", path);
+            break;
+        }
+        struct hirc_object object = {.type = bnk_file->data[position]};
+        memcpy(&object.length, &bnk_file->data[position + 1], 4);
+        position += 5;
+        if (object.length > section_end - position) {
+            eprintf("Error: HIRC section of \"%s\" is truncated.\n", path);
+            break;
+        }
+        object.position = position;
+        add_object(&objects, &object);
+        position += object.length;
+    }
+    dprintf("objects read: %u, num of objects: %u\n", objects.length, num_of_objects);
+    if (objects.length != num_of_objects)
+        v_printf(1, "Read %u HIRC objects, but the bank claims to have %u.\n", objects.length, num_of_objects);
+    dprintf("Current offset: %" PRIu64 "\n", position);
+
+    struct hirc_sections sections = {*sounds, *event_actions, *events, *random_containers, *music_segments, *music_tracks, *music_playlists};
+    uint32_t thread_count = min(get_cpu_count(), objects.length / MIN_OBJECTS_PER_THREAD);
+    if (thread_count <= 1) {
+        struct hirc_chunk chunk = {.bnk_file = bnk_file, .objects = objects.objects, .object_count = objects.length, .bnk_version = bnk_version, .sections = sections};
+        decode_hirc_objects(&chunk);
+        sections = chunk.sections;
+    } else {
+        struct hirc_chunk* chunks = malloc(thread_count * sizeof(struct hirc_chunk));
+        pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+        bool* started = malloc(thread_count * sizeof(bool));
+        for (uint32_t i = 0; i < thread_count; i++) {
+            uint32_t first_object = (uint64_t) objects.length * i / thread_count;
+            uint32_t end_object = (uint64_t) objects.length * (i + 1) / thread_count;
+            chunks[i] = (struct hirc_chunk) {
+                .bnk_file = bnk_file,
+                .objects = &objects.objects[first_object],
+                .object_count = end_object - first_object,
+                .bnk_version = bnk_version
+            };
+            initialize_sections(&chunks[i].sections);
+            started[i] = pthread_create(&threads[i], NULL, decode_hirc_objects, &chunks[i]) == 0;
+            if (!started[i])
+                decode_hirc_objects(&chunks[i]);
+        }
+        for (uint32_t i = 0; i < thread_count; i++) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+            append_sections(&sections, &chunks[i].sections);
+        }
+        free(started);
+        free(threads);
+        free(chunks);
+    }
+    *sounds = sections.sounds;
+    *event_actions = sections.event_actions;
+    *events = sections.events;
+    *random_containers = sections.random_containers;
+    *music_segments = sections.music_segments;
+    *music_tracks = sections.music_tracks;
+    *music_playlists = sections.music_playlists;
+    free(objects.objects);
 
     for (uint32_t i = 0; i < sounds->length; i++) {
         dprintf("sound object id: %u, source id: %u, file id: %u\n", sounds->objects[i].sound_object_id, sounds->objects[i].source_id, sounds->objects[i].file_id);
@@ -355,17 +556,129 @@ int parse_event_bnk_file(char* path, SoundSection* sounds, EventActionSection* e
         dprintf("event action sound object ids: %u\n", event_actions->objects[i].sound_object_id);
     }
 
-    fclose(bnk_file);
+    unmap_file(bnk_file);
 
     return 0;
 }
 
 
+// indexes from the ids a play action can refer to, to the objects that lead to wem files. Built once per bank.
+struct event_resolver {
+    SoundSection* sounds;
+    RandomContainerSection* random_containers;
+    MusicContainerSection* music_segments; // must be sorted by self_id
+    MusicTrackSection* music_tracks; // must be sorted by self_id
+    MusicContainerSection* music_playlists;
+    IdIndex sounds_by_id; // both sound_object_id and self_id
+    IdIndex random_containers_by_switch_container_id;
+    IdIndex music_segments_by_sound_object_id;
+    IdIndex music_playlists_by_sound_object_id;
+};
+
+void initialize_event_resolver(struct event_resolver* event_resolver, SoundSection* sounds, RandomContainerSection* random_containers, MusicContainerSection* music_segments, MusicTrackSection* music_tracks, MusicContainerSection* music_playlists)
+{
+    *event_resolver = (struct event_resolver) {
+        .sounds = sounds,
+        .random_containers = random_containers,
+        .music_segments = music_segments,
+        .music_tracks = music_tracks,
+        .music_playlists = music_playlists
+    };
+    initialize_id_index(&event_resolver->sounds_by_id);
+    initialize_id_index(&event_resolver->random_containers_by_switch_container_id);
+    initialize_id_index(&event_resolver->music_segments_by_sound_object_id);
+    initialize_id_index(&event_resolver->music_playlists_by_sound_object_id);
+
+    for (uint32_t i = 0; i < sounds->length; i++) {
+        add_id(&event_resolver->sounds_by_id, sounds->objects[i].sound_object_id, i);
+        if (sounds->objects[i].self_id != sounds->objects[i].sound_object_id)
+            add_id(&event_resolver->sounds_by_id, sounds->objects[i].self_id, i);
+    }
+    for (uint32_t i = 0; i < random_containers->length; i++) {
+        add_id(&event_resolver->random_containers_by_switch_container_id, random_containers->objects[i].switch_container_id, i);
+    }
+    for (uint32_t i = 0; i < music_segments->length; i++) {
+        add_id(&event_resolver->music_segments_by_sound_object_id, music_segments->objects[i].sound_object_id, i);
+    }
+    for (uint32_t i = 0; i < music_playlists->length; i++) {
+        add_id(&event_resolver->music_playlists_by_sound_object_id, music_playlists->objects[i].sound_object_id, i);
+    }
+
+    build_id_index(&event_resolver->sounds_by_id);
+    build_id_index(&event_resolver->random_containers_by_switch_container_id);
+    build_id_index(&event_resolver->music_segments_by_sound_object_id);
+    build_id_index(&event_resolver->music_playlists_by_sound_object_id);
+}
+
+void free_event_resolver(struct event_resolver* event_resolver)
+{
+    free_id_index(&event_resolver->sounds_by_id);
+    free_id_index(&event_resolver->random_containers_by_switch_container_id);
+    free_id_index(&event_resolver->music_segments_by_sound_object_id);
+    free_id_index(&event_resolver->music_playlists_by_sound_object_id);
+}
+
+static void add_music_segment_files(struct event_resolver* event_resolver, struct string_hash* event_string, struct music_container* music_segment, StringHashes* string_files)
+{
+    for (uint32_t i = 0; i < music_segment->music_track_id_amount; i++) {
+        struct music_track* music_track = NULL;
+        find_object_s(event_resolver->music_tracks, music_track, self_id, music_segment->music_track_ids[i]);
+        if (!music_track) continue;
+        v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", event_string->hash, event_string->string, music_track->file_id);
+        add_object(string_files, (&(struct string_hash) {event_string->string, music_track->file_id, music_segment->self_id}));
+    }
+}
+
+// adds every wem file that a "play" action on sound_object_id leads to, paired with the event's string, to string_files.
+// Sounds come first, then music segments, music playlists and random containers, each in the order of their section.
+void resolve_play_action(struct event_resolver* event_resolver, struct string_hash* event_string, uint32_t sound_object_id, StringHashes* string_files)
+{
+    uint32_t count;
+    const uint32_t* positions = find_id(&event_resolver->sounds_by_id, sound_object_id, &count);
+    for (uint32_t i = 0; i < count; i++) {
+        struct sound* sound = &event_resolver->sounds->objects[positions[i]];
+        dprintf("Found one!\n");
+        v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", event_string->hash, event_string->string, sound->file_id);
+        add_object(string_files, (&(struct string_hash) {event_string->string, sound->file_id, 0}));
+    }
+
+    positions = find_id(&event_resolver->music_segments_by_sound_object_id, sound_object_id, &count);
+    for (uint32_t i = 0; i < count; i++) {
+        add_music_segment_files(event_resolver, event_string, &event_resolver->music_segments->objects[positions[i]], string_files);
+    }
+
+    positions = find_id(&event_resolver->music_playlists_by_sound_object_id, sound_object_id, &count);
+    for (uint32_t i = 0; i < count; i++) {
+        struct music_container* music_playlist = &event_resolver->music_playlists->objects[positions[i]];
+        for (uint32_t j = 0; j < music_playlist->music_track_id_amount; j++) {
+            struct music_container* music_segment = NULL;
+            find_object_s(event_resolver->music_segments, music_segment, self_id, music_playlist->music_track_ids[j]);
+            if (!music_segment) continue;
+            add_music_segment_files(event_resolver, event_string, music_segment, string_files);
+        }
+    }
+
+    positions = find_id(&event_resolver->random_containers_by_switch_container_id, sound_object_id, &count);
+    for (uint32_t i = 0; i < count; i++) {
+        struct random_container* random_container = &event_resolver->random_containers->objects[positions[i]];
+        for (uint32_t j = 0; j < random_container->sound_id_amount; j++) {
+            uint32_t sound_count;
+            const uint32_t* sound_positions = find_id(&event_resolver->sounds_by_id, random_container->sound_ids[j], &sound_count);
+            for (uint32_t k = 0; k < sound_count; k++) {
+                struct sound* sound = &event_resolver->sounds->objects[sound_positions[k]];
+                v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", event_string->hash, event_string->string, sound->file_id);
+                add_object(string_files, (&(struct string_hash) {event_string->string, sound->file_id, random_container->self_id}));
+            }
+        }
+    }
+}
+
+
 #define VERSION "1.6"
 void print_help()
 {
     printf("bnk-extract "VERSION" - a tool to extract bnk and wpk files, optionally sorting them into named groups.\n\n");
-    printf("Syntax: ./bnk-extract --audio path/to/audio.[bnk|wpk] [--bin path/to/skinX.bin --events path/to/events.bnk] [-o path/to/output] [--wems-only] [--oggs-only]\n\n");
+    printf("Syntax: ./bnk-extract --audio path/to/audio.[bnk|wpk] [--bin path/to/skinX.bin --events path/to/events.bnk] [-o path/to/output] [--wems-only] [--oggs-only] [--jobs N]\n\n");
     printf("Options: \n");
     printf("  [-a|--audio] path\n    Specify the path to the audio bnk/wpk file that is to be extracted (mandatory).\n    Specifying this option without -e and -b will only extract files without grouping them by event name.\n\n");
     printf("  [-e|--events] path\n    Specify the path to the events bnk file that contains information about the events that trigger certain audio files.\n\n");
@@ -373,9 +686,29 @@ void print_help()
     printf("  [-o|--output] path\n    Specify output path. Default is \"output\".\n\n");
     printf("  [--wems-only]\n    Extract wem files only.\n\n");
     printf("  [--oggs-only]\n    Extract ogg files only.\n    By default, both .wem and converted .ogg files will be extracted.\n\n");
+    printf("  [-j|--jobs] N\n    Amount of threads that write and convert the extracted files. Default is one per cpu.\n\n");
+    printf("  [--memory-cap] megabytes\n    Upper bound for the wems read ahead and the converted files waiting to be written. Default is 256.\n\n");
+    printf("  [--lazy]\n    Only read the index of the audio file up front and load every wem when it is first used.\n\n");
+    printf("  [--cache-size] megabytes\n    Upper bound for the wems that are kept loaded with --lazy when no longer in use. Default is 64.\n\n");
     printf("  [-v [-v ...]]\n    Increases verbosity level by one per \"-v\".\n");
 }
 
+WemInformation* parse_audio_file(char* audio_path, StringHashes* string_hashes, bool lazy, uint64_t cache_size)
+{
+    WemInformation* wem_information;
+    bool is_bnk = strlen(audio_path) >= 4 && memcmp(&audio_path[strlen(audio_path) - 4], ".bnk", 4) == 0;
+    if (lazy)
+        wem_information = is_bnk ? parse_audio_bnk_index(audio_path, string_hashes, cache_size) : parse_wpk_index(audio_path, string_hashes, cache_size);
+    else
+        wem_information = is_bnk ? parse_audio_bnk_file(audio_path, string_hashes) : parse_wpk_file(audio_path, string_hashes);
+    if (!wem_information)
+        return NULL;
+
+    wem_information->grouped_wems->string = strdup(audio_path);
+
+    return wem_information;
+}
+
 WemInformation* bnk_extract(int argc, char* argv[])
 {
     if (argc < 2) {
@@ -390,6 +723,8 @@ WemInformation* bnk_extract(int argc, char* argv[])
     char* bin_path = NULL;
     char* audio_path = NULL;
     char* events_path = NULL;
+    bool lazy = false;
+    uint64_t cache_size = 64;
     for (char** arg = &argv[1]; *arg; arg++) {
         if (strcmp(*arg, "-a") == 0 || strcmp(*arg, "--audio") == 0) {
             if (*(arg + 1)) {
@@ -406,6 +741,13 @@ WemInformation* bnk_extract(int argc, char* argv[])
                 arg++;
                 bin_path = *arg;
             }
+        } else if (strcmp(*arg, "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(*arg, "--cache-size") == 0) {
+            if (*(arg + 1)) {
+                arg++;
+                cache_size = strtoull(*arg, NULL, 10);
+            }
         } else if (strcmp(*arg, "-v") == 0) {
             VERBOSE++;
         }
@@ -422,12 +764,8 @@ WemInformation* bnk_extract(int argc, char* argv[])
     initialize_list(&string_files);
     WemInformation* wem_information;
     if (!bin_path) {
-        if (strlen(audio_path) >= 4 && memcmp(&audio_path[strlen(audio_path) - 4], ".bnk", 4) == 0)
-            wem_information = parse_audio_bnk_file(audio_path, &string_files);
-        else
-            wem_information = parse_wpk_file(audio_path, &string_files);
+        wem_information = parse_audio_file(audio_path, &string_files, lazy, cache_size * 1024 * 1024);
         free(string_files.objects);
-        if (wem_information) wem_information->grouped_wems->string = strdup(audio_path);
         return wem_information;
     }
 
@@ -460,6 +798,9 @@ WemInformation* bnk_extract(int argc, char* argv[])
     sort_list(&music_segments, self_id);
     sort_list(&music_tracks, self_id);
 
+    struct event_resolver event_resolver;
+    initialize_event_resolver(&event_resolver, &sounds, &random_containers, &music_segments, &music_tracks, &music_playlists);
+
     dprintf("amount: %u\n", read_strings->length);
     for (uint32_t i = 0; i < read_strings->length; i++) {
         uint32_t hash = read_strings->objects[i].hash;
@@ -471,67 +812,21 @@ WemInformation* bnk_extract(int argc, char* argv[])
         for (uint32_t j = 0; j < event->event_amount; j++) {
             struct event_action* event_action = NULL;
             find_object_s(&event_actions, event_action, self_id, event->event_ids[j]);
-            if (event_action && event_action->type == 4 /* "play" */) {
-                for (uint32_t k = 0; k < sounds.length; k++) {
-                    if (sounds.objects[k].sound_object_id == event_action->sound_object_id || sounds.objects[k].self_id == event_action->sound_object_id) {
-                        dprintf("Found one!\n");
-                        v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", hash, read_strings->objects[i].string, sounds.objects[k].file_id);
-                        add_object(&string_files, (&(struct string_hash) {read_strings->objects[i].string, sounds.objects[k].file_id, 0}));
-                    }
-                }
-                for (uint32_t k = 0; k < music_segments.length; k++) {
-                    if (music_segments.objects[k].sound_object_id == event_action->sound_object_id) {
-                        for (uint32_t l = 0; l < music_segments.objects[k].music_track_id_amount; l++) {
-                            struct music_track* music_track = NULL;
-                            find_object_s(&music_tracks, music_track, self_id, music_segments.objects[k].music_track_ids[l]);
-                            if (!music_track) continue;
-                            dprintf("Found one 1!\n");
-                            v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", hash, read_strings->objects[i].string, music_track->file_id);
-                            add_object(&string_files, (&(struct string_hash) {read_strings->objects[i].string, music_track->file_id, music_segments.objects[k].self_id}));
-                        }
-                    }
-                }
-                for (uint32_t k = 0; k < music_playlists.length; k++) {
-                    if (music_playlists.objects[k].sound_object_id == event_action->sound_object_id) {
-                        for (uint32_t l = 0; l < music_playlists.objects[k].music_track_id_amount; l++) {
-                            struct music_container* music_segment = NULL;
-                            find_object_s(&music_segments, music_segment, self_id, music_playlists.objects[k].music_track_ids[l]);
-                            if (!music_segment) continue;
-                            for (uint32_t m = 0; m < music_segment->music_track_id_amount; m++) {
-                                struct music_track* music_track = NULL;
-                                find_object_s(&music_tracks, music_track, self_id, music_segment->music_track_ids[m]);
-                                if (!music_track) continue;
-                                dprintf("Found one 2!\n");
-                                v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", hash, read_strings->objects[i].string, music_track->file_id);
-                                add_object(&string_files, (&(struct string_hash) {read_strings->objects[i].string, music_track->file_id, music_segment->self_id}));
-                            }
-                        }
-                    }
-                }
-                for (uint32_t k = 0; k < random_containers.length; k++) {
-                    if (random_containers.objects[k].switch_container_id == event_action->sound_object_id) {
-                        for (uint32_t l = 0; l < random_containers.objects[k].sound_id_amount; l++) {
-                            for (uint32_t m = 0; m < sounds.length; m++) {
-                                if (random_containers.objects[k].sound_ids[l] == sounds.objects[m].self_id || random_containers.objects[k].sound_ids[l] == sounds.objects[m].sound_object_id) {
-                                    dprintf("sound id amount? %u\n", random_containers.objects[k].sound_id_amount);
-                                    dprintf("Found one precisely here.\n");
-                                    v_printf(2, "Hash %u of string %s belongs to file \"%u.wem\".\n", hash, read_strings->objects[i].string, sounds.objects[m].file_id);
-                                    add_object(&string_files, (&(struct string_hash) {read_strings->objects[i].string, sounds.objects[m].file_id, random_containers.objects[k].self_id}));
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+            if (event_action && event_action->type == 4 /* "play" */)
+                resolve_play_action(&event_resolver, &read_strings->objects[i], event_action->sound_object_id, &string_files);
         }
     }
+    free_event_resolver(&event_resolver);
 
     sort_list(&string_files, hash);
-    if (strlen(audio_path) >= 4 && memcmp(&audio_path[strlen(audio_path) - 4], ".bnk", 4) == 0)
-        wem_information = parse_audio_bnk_file(audio_path, &string_files);
-    else
-        wem_information = parse_wpk_file(audio_path, &string_files);
-    if (wem_information) wem_information->grouped_wems->string = strdup(audio_path);
+    wem_information = parse_audio_file(audio_path, &string_files, lazy, cache_size * 1024 * 1024);
+    // kept for find_wem_events, along with the strings they point to
+    if (wem_information) {
+        wem_information->wem_events = malloc(sizeof(WemEvents));
+        *wem_information->wem_events = (WemEvents) {.event_strings = read_strings, .file_events = string_files};
+        read_strings = NULL;
+        string_files.objects = NULL;
+    }
 
     free_and_return:;
     free_sound_section(&sounds);
@@ -543,11 +838,13 @@ WemInformation* bnk_extract(int argc, char* argv[])
     free_music_container_section(&music_playlists);
 
     free(string_files.objects);
-    for (uint32_t i = 0; i < read_strings->length; i++) {
-        free(read_strings->objects[i].string);
+    if (read_strings) {
+        for (uint32_t i = 0; i < read_strings->length; i++) {
+            free(read_strings->objects[i].string);
+        }
+        free(read_strings->objects);
+        free(read_strings);
     }
-    free(read_strings->objects);
-    free(read_strings);
 
     return wem_information;
 }
@@ -0,0 +1,213 @@
+// checks that converting a wem takes as many allocations as converting a far longer one, i.e. that the packet loop allocates nothing.
+// The long wem is the given one with its audio packets repeated. Pick a wem with mod packets, that is where the loop does the most.
+// Linked with --wrap for malloc, calloc and realloc, operator new is replaced to go through malloc as well.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "../defs.h"
+#include "../ww2ogg/api.h"
+
+static unsigned long allocation_count = 0;
+
+extern "C" {
+
+FILE* consoleless_stderr;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    allocation_count++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    allocation_count++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* pointer, size_t size)
+{
+    allocation_count++;
+    return __real_realloc(pointer, size);
+}
+
+}
+
+void* operator new(size_t size)
+{
+    void* pointer = malloc(size ? size : 1);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+static int read_file(const char* path, AudioData* wem)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    wem->length = length;
+    wem->data = (uint8_t*) malloc(length ? length : 1);
+    size_t read_bytes = fread(wem->data, 1, length, file);
+    fclose(file);
+
+    return read_bytes == (size_t) length ? 0 : -1;
+}
+
+static uint32_t read_length(const uint8_t* field, bool big_endian)
+{
+    if (big_endian)
+        return (uint32_t) field[0] << 24 | (uint32_t) field[1] << 16 | (uint32_t) field[2] << 8 | field[3];
+    uint32_t length;
+    memcpy(&length, field, 4);
+    return length;
+}
+
+static void add_to_length(uint8_t* field, uint32_t added, bool big_endian)
+{
+    uint32_t length = read_length(field, big_endian) + added;
+    if (big_endian) {
+        for (int i = 0; i < 4; i++) {
+            field[i] = (uint8_t) (length >> (24 - 8 * i));
+        }
+    } else {
+        memcpy(field, &length, 4);
+    }
+}
+
+// offset of the chunk called name in a RIFF or RIFX file, -1 if there is none
+static long find_chunk(const AudioData* wem, const char name[4], bool big_endian)
+{
+    uint64_t offset = 12;
+    while (offset + 8 <= wem->length) {
+        if (memcmp(&wem->data[offset], name, 4) == 0)
+            return offset;
+        offset += 8 + (uint64_t) read_length(&wem->data[offset + 4], big_endian);
+    }
+
+    return -1;
+}
+
+// copies wem with all of its audio packets repeat_count times in a row
+static int repeat_audio_packets(const AudioData* wem, const struct ww2ogg_options* options, uint32_t repeat_count, AudioData* long_wem)
+{
+    if (wem->length < 12 || (memcmp(wem->data, "RIFF", 4) != 0 && memcmp(wem->data, "RIFX", 4) != 0))
+        return -1;
+    bool big_endian = memcmp(wem->data, "RIFX", 4) == 0;
+    struct ww2ogg_packet_table table;
+    if (ww2ogg_scan_packets(wem, options, &table) == -1)
+        return -1;
+    long data_chunk = find_chunk(wem, "data", big_endian);
+    if (table.packet_count < 2 || data_chunk == -1) {
+        ww2ogg_free_packet_table(&table);
+        return -1;
+    }
+    uint32_t header_size = table.offsets[1] - table.offsets[0] - table.sizes[0];
+    uint32_t packets_start = table.offsets[0] - header_size;
+    uint32_t packets_end = table.offsets[table.packet_count - 1] + table.sizes[table.packet_count - 1];
+    ww2ogg_free_packet_table(&table);
+
+    uint32_t packets_length = packets_end - packets_start;
+    uint32_t added = (repeat_count - 1) * packets_length;
+    long_wem->length = wem->length + added;
+    long_wem->data = (uint8_t*) malloc(long_wem->length);
+    memcpy(long_wem->data, wem->data, packets_end);
+    for (uint32_t i = 1; i < repeat_count; i++) {
+        memcpy(&long_wem->data[packets_start + i * packets_length], &wem->data[packets_start], packets_length);
+    }
+    memcpy(&long_wem->data[packets_end + added], &wem->data[packets_end], wem->length - packets_end);
+    add_to_length(&long_wem->data[4], added, big_endian);
+    add_to_length(&long_wem->data[data_chunk + 4], added, big_endian);
+
+    return 0;
+}
+
+static int discard(const uint8_t*, uint64_t, void*)
+{
+    return 0;
+}
+
+// the allocations of a conversion to a sink that drops the ogg, so that a growing output buffer does not count
+static long count_allocations(const AudioData* wem, const struct ww2ogg_options* options)
+{
+    OutputSink sink;
+    begin_callback_output(&sink, discard, NULL);
+    unsigned long before = allocation_count;
+    if (ww2ogg_convert_to_sink(wem, options, &sink) == -1)
+        return -1;
+
+    return allocation_count - before;
+}
+
+int main(int argc, char** argv)
+{
+    struct ww2ogg_options options = {};
+    char* wem_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--inline-codebooks") == 0)
+            options.inline_codebooks = true;
+        else if (strcmp(argv[i], "--full-setup") == 0)
+            options.full_setup = true;
+        else
+            wem_path = argv[i];
+    }
+    if (!wem_path) {
+        printf("Usage: %s [--inline-codebooks] [--full-setup] file.wem (or make alloc-test WEM=file.wem)\n", argv[0]);
+        return 2;
+    }
+
+    AudioData wem = {};
+    AudioData long_wem = {};
+    if (read_file(wem_path, &wem) == -1 || repeat_audio_packets(&wem, &options, 64, &long_wem) == -1) {
+        printf("alloc-test: \"%s\" is not a vorbis wem with at least two audio packets\n", wem_path);
+        return 2;
+    }
+
+    // the first conversion also fills the codebook and setup caches
+    count_allocations(&wem, &options);
+    long short_count = count_allocations(&wem, &options);
+    long long_count = count_allocations(&long_wem, &options);
+    if (short_count == -1 || long_count == -1) {
+        printf("alloc-test: failed to convert \"%s\"\n", wem_path);
+        return 2;
+    }
+
+    printf("alloc-test: %ld allocations for %" PRIu32 " bytes, %ld for %" PRIu32 " bytes\n", short_count, wem.length, long_count, long_wem.length);
+    free(wem.data);
+    free(long_wem.data);
+    return short_count == long_count ? 0 : 1;
+}
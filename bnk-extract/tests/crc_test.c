@@ -0,0 +1,130 @@
+// checks every path of the ogg page checksum against the byte-wise Tremor loop it replaced and reports their throughput.
+// crc.c is included so that the slicing-by-8 and the pclmul path can be called directly, not just the one this cpu picks.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../ww2ogg/crc.c"
+
+#define BUFFER_SIZE (1 << 20)
+
+static uint64_t random_state = 0x9E3779B97F4A7C15;
+
+static uint64_t next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// how checksum() worked before, one table lookup per byte
+static uint32_t checksum_bytewise(uint32_t crc, const unsigned char* data, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        crc = (crc << 8) ^ crc_lookup[(crc >> 24) ^ data[i]];
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+static bool has_pclmul(void)
+{
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+// the pclmul path only takes multiples of 16 bytes that are at least 64, the rest goes through the byte-wise loop
+static uint32_t checksum_folded(uint32_t crc, const unsigned char* data, size_t length)
+{
+    if (length < 64)
+        return checksum_bytewise(crc, data, length);
+    size_t folded_length = length & ~(size_t) 15;
+    return checksum_bytewise(checksum_pclmul(crc, data, folded_length), &data[folded_length], length - folded_length);
+}
+#endif
+
+static int mismatches = 0;
+
+static void expect(const char* what, size_t length, uint32_t got, uint32_t expected)
+{
+    if (got == expected)
+        return;
+    if (mismatches++ < 10)
+        printf("mismatch: %s of %zu bytes is %08x, expected %08x\n", what, length, got, expected);
+}
+
+static void check(const unsigned char* data, size_t length)
+{
+    uint32_t expected = checksum_bytewise(0, data, length);
+    expect("slicing-by-8", length, checksum_sliced(0, data, length), expected);
+#if defined(__x86_64__)
+    if (has_pclmul())
+        expect("pclmul", length, checksum_folded(0, data, length), expected);
+#endif
+    expect("checksum", length, checksum((unsigned char*) data, length), expected);
+
+    size_t split = length ? next_random() % (length + 1) : 0;
+    uint32_t first = checksum_bytewise(0, data, split);
+    expect("checksum_update", length, checksum_update(checksum_update(0, data, split), &data[split], length - split), expected);
+    expect("checksum_combine", length, checksum_combine(first, checksum_bytewise(0, &data[split], length - split), length - split), expected);
+}
+
+// keeps the timed loops from being optimized away
+static volatile uint32_t sink;
+
+static double seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void measure(const char* name, uint32_t (*function)(uint32_t, const unsigned char*, size_t), const unsigned char* data, int rounds)
+{
+    uint32_t crc = 0;
+    double start = seconds();
+    for (int i = 0; i < rounds; i++) {
+        crc = function(crc, data, BUFFER_SIZE);
+    }
+    double elapsed = seconds() - start;
+    sink = crc;
+    printf("%-14s %9.1f MB/s\n", name, (double) rounds * BUFFER_SIZE / elapsed / 1e6);
+}
+
+int main(void)
+{
+    unsigned char* data = malloc(BUFFER_SIZE);
+    for (size_t i = 0; i < BUFFER_SIZE; i++) {
+        data[i] = (unsigned char) next_random();
+    }
+
+    // every length around the 16 and 64 byte steps of the folding, then random lengths at random, unaligned offsets
+    for (size_t length = 0; length <= 300; length++) {
+        check(&data[length % 7], length);
+    }
+    for (int i = 0; i < 2000; i++) {
+        size_t length = next_random() % 70000;
+        check(&data[next_random() % (BUFFER_SIZE - length)], length);
+    }
+    check(data, BUFFER_SIZE);
+    if (mismatches) {
+        printf("crc-test: %d mismatches\n", mismatches);
+        return 1;
+    }
+    printf("crc-test: all paths agree with the byte-wise checksum\n");
+
+    measure("byte-wise", checksum_bytewise, data, 50);
+    measure("slicing-by-8", checksum_sliced, data, 200);
+#if defined(__x86_64__)
+    if (has_pclmul())
+        measure("pclmul", checksum_folded, data, 1000);
+    else
+        printf("pclmul         not supported by this cpu\n");
+#endif
+    measure("checksum", checksum_update, data, 1000);
+
+    free(data);
+    return 0;
+}
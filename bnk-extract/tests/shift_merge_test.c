@@ -0,0 +1,195 @@
+// checks the avx2, sse2 and scalar paths of shift_merge_bytes against the put_bits loop they replaced at every bit offset,
+// then reports the throughput of each.
+// shift_merge.c is included so that every path can be called directly, not just the one this cpu picks.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../ww2ogg/shift_merge.c"
+
+#define BUFFER_SIZE (1 << 20)
+#define PATH_COUNT 5
+
+static uint64_t random_state = 0x9E3779B97F4A7C15;
+
+static uint64_t next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// how Bit_oggstream::put_bytes worked before: put_bits of every 32 bit word, then of the remaining bytes,
+// through an accumulator that starts out with the shift bits of carry
+static uint8_t put_bytes_bitwise(uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry)
+{
+    uint64_t bit_buffer = carry;
+    unsigned int bits_stored = shift;
+    size_t output_length = 0;
+    for (; length >= 4; input += 4, length -= 4) {
+        uint32_t word = (uint32_t) input[0] | (uint32_t) input[1] << 8 | (uint32_t) input[2] << 16 | (uint32_t) input[3] << 24;
+        bit_buffer |= (uint64_t) word << bits_stored;
+        bits_stored += 32;
+        for (; bits_stored >= 8; bits_stored -= 8, bit_buffer >>= 8) {
+            output[output_length++] = (uint8_t) bit_buffer;
+        }
+    }
+    for (; length > 0; input++, length--) {
+        bit_buffer |= (uint64_t) *input << bits_stored;
+        bits_stored += 8;
+        for (; bits_stored >= 8; bits_stored -= 8, bit_buffer >>= 8) {
+            output[output_length++] = (uint8_t) bit_buffer;
+        }
+    }
+
+    return (uint8_t) bit_buffer;
+}
+
+// the same steps as shift_merge_bytes, with path doing the bulk of the bytes (all of them go through the scalar loop without one)
+static uint8_t shift_merge_with(size_t (*path)(uint8_t*, const uint8_t*, size_t, size_t, unsigned int), uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry)
+{
+    if (length == 0)
+        return carry;
+
+    output[0] = (uint8_t) (input[0] << shift | carry);
+    size_t i = path ? path(output, input, 1, length, shift) : 1;
+    shift_merge_scalar(output, input, i, length, shift);
+
+    return input[length - 1] >> (8 - shift);
+}
+
+static uint8_t shift_merge_scalar_only(uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry)
+{
+    return shift_merge_with(NULL, output, input, length, shift, carry);
+}
+
+#ifdef __SSE2__
+static uint8_t shift_merge_sse2_only(uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry)
+{
+    return shift_merge_with(shift_merge_sse2, output, input, length, shift, carry);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint8_t shift_merge_avx2_only(uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry)
+{
+    return shift_merge_with(shift_merge_avx2, output, input, length, shift, carry);
+}
+#endif
+
+struct path {
+    const char* name;
+    uint8_t (*function)(uint8_t*, const uint8_t*, size_t, unsigned int, uint8_t);
+    bool supported;
+};
+
+static struct path paths[PATH_COUNT] = {
+    {"bit-by-bit", put_bytes_bitwise, true},
+    {"scalar", shift_merge_scalar_only, true},
+#ifdef __SSE2__
+    {"sse2", shift_merge_sse2_only, true},
+#else
+    {"sse2", NULL, false},
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", shift_merge_avx2_only, false}, // supported once the cpu is checked in main
+#else
+    {"avx2", NULL, false},
+#endif
+    {"shift_merge_bytes", shift_merge_bytes, true}
+};
+
+static int mismatches = 0;
+
+static void check(uint8_t* expected, uint8_t* output, const uint8_t* input, size_t length, unsigned int shift)
+{
+    uint8_t carry = (uint8_t) (next_random() & ((1u << shift) - 1));
+    uint8_t expected_carry = put_bytes_bitwise(expected, input, length, shift, carry);
+    for (int p = 1; p < PATH_COUNT; p++) {
+        if (!paths[p].supported)
+            continue;
+        // the byte past the end must stay untouched
+        memset(output, 0xA5, length + 1);
+        uint8_t new_carry = paths[p].function(output, input, length, shift, carry);
+        if ((new_carry != expected_carry || memcmp(output, expected, length) != 0 || output[length] != 0xA5) && mismatches++ < 10)
+            printf("mismatch: %s of %zu bytes shifted by %u\n", paths[p].name, length, shift);
+    }
+}
+
+// keeps the timed loops from being optimized away
+static volatile uint8_t sink;
+
+static double seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double measure(const struct path* path, uint8_t* output, const uint8_t* input, unsigned int shift, int rounds)
+{
+    uint8_t carry = 0;
+    double start = seconds();
+    for (int i = 0; i < rounds; i++) {
+        carry = path->function(output, input, BUFFER_SIZE, shift, carry);
+    }
+    double elapsed = seconds() - start;
+    sink = carry ^ output[BUFFER_SIZE - 1];
+
+    return (double) rounds * BUFFER_SIZE / elapsed;
+}
+
+int main(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    paths[3].supported = __builtin_cpu_supports("avx2");
+#endif
+
+    // one spare byte in front for the unaligned inputs, one behind the outputs to catch overruns
+    uint8_t* input = malloc(BUFFER_SIZE + 1);
+    uint8_t* expected = malloc(BUFFER_SIZE + 1);
+    uint8_t* output = malloc(BUFFER_SIZE + 1);
+    for (size_t i = 0; i < BUFFER_SIZE + 1; i++) {
+        input[i] = (uint8_t) next_random();
+    }
+
+    // shift 0 is a plain copy, which put_bytes does with memcpy, but the kernels handle it all the same
+    for (unsigned int shift = 0; shift < 8; shift++) {
+        for (size_t length = 0; length <= 300; length++) {
+            check(expected, output, &input[length & 1], length, shift);
+        }
+        for (int i = 0; i < 200; i++) {
+            size_t length = next_random() % 70000;
+            check(expected, output, &input[next_random() % (BUFFER_SIZE + 1 - length)], length, shift);
+        }
+    }
+    if (mismatches) {
+        printf("shift-merge-test: %d mismatches\n", mismatches);
+        return 1;
+    }
+    printf("shift-merge-test: all paths agree with the bit-by-bit copy\n");
+
+    printf("shift");
+    for (int p = 0; p < PATH_COUNT; p++) {
+        printf(" %17s", paths[p].name);
+    }
+    printf("   (MB/s)\n");
+    for (unsigned int shift = 0; shift < 8; shift++) {
+        printf("%5u", shift);
+        for (int p = 0; p < PATH_COUNT; p++) {
+            if (paths[p].supported)
+                printf(" %17.1f", measure(&paths[p], output, &input[1], shift, p == 0 ? 50 : 200) / 1e6);
+            else
+                printf(" %17s", "-");
+        }
+        printf("\n");
+    }
+
+    free(input);
+    free(expected);
+    free(output);
+    return 0;
+}
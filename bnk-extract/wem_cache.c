@@ -0,0 +1,261 @@
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "defs.h"
+#include "static_list.h"
+#include "wem_cache.h"
+
+#define NO_SLOT UINT64_MAX
+
+struct cache_slot {
+    uint8_t* data; // NULL while not loaded
+    uint64_t offset;
+    uint32_t length; // length of data, audio_data->length may change afterwards through replace_audio_data
+    uint32_t pins;
+    // neighbours in the lru list. Only loaded slots without pins are in there.
+    uint64_t previous;
+    uint64_t next;
+};
+
+struct wem_cache {
+    pthread_mutex_t lock;
+#ifdef _WIN32
+    HANDLE file;
+#else
+    int fd;
+#endif
+    uint64_t file_length;
+    AudioData* entries;
+    struct cache_slot* slots;
+    uint64_t entry_count;
+    uint64_t byte_budget;
+    uint64_t cached_bytes;
+    uint64_t lru_head; // least recently used
+    uint64_t lru_tail;
+};
+
+// positional read, so that several threads can read from the same file without sharing a file position
+static int read_at(WemCache* wem_cache, uint8_t* buffer, uint64_t offset, uint64_t length)
+{
+    while (length > 0) {
+#ifdef _WIN32
+        OVERLAPPED position = {.Offset = (DWORD) offset, .OffsetHigh = (DWORD) (offset >> 32)};
+        DWORD read_bytes;
+        if (!ReadFile(wem_cache->file, buffer, length < UINT32_MAX ? length : UINT32_MAX, &read_bytes, &position) || read_bytes == 0)
+            return -1;
+#else
+        ssize_t read_bytes = pread(wem_cache->fd, buffer, length, offset);
+        if (read_bytes <= 0)
+            return -1;
+#endif
+        buffer += read_bytes;
+        offset += read_bytes;
+        length -= read_bytes;
+    }
+
+    return 0;
+}
+
+static void unlink_slot(WemCache* wem_cache, uint64_t index)
+{
+    struct cache_slot* slot = &wem_cache->slots[index];
+    if (slot->previous != NO_SLOT)
+        wem_cache->slots[slot->previous].next = slot->next;
+    else
+        wem_cache->lru_head = slot->next;
+    if (slot->next != NO_SLOT)
+        wem_cache->slots[slot->next].previous = slot->previous;
+    else
+        wem_cache->lru_tail = slot->previous;
+}
+
+static void append_slot(WemCache* wem_cache, uint64_t index)
+{
+    struct cache_slot* slot = &wem_cache->slots[index];
+    slot->previous = wem_cache->lru_tail;
+    slot->next = NO_SLOT;
+    if (wem_cache->lru_tail != NO_SLOT)
+        wem_cache->slots[wem_cache->lru_tail].next = index;
+    else
+        wem_cache->lru_head = index;
+    wem_cache->lru_tail = index;
+}
+
+// must be called with the lock held
+static void evict_unused(WemCache* wem_cache)
+{
+    while (wem_cache->cached_bytes > wem_cache->byte_budget && wem_cache->lru_head != NO_SLOT) {
+        uint64_t index = wem_cache->lru_head;
+        struct cache_slot* slot = &wem_cache->slots[index];
+        unlink_slot(wem_cache, index);
+        if (!wem_cache->entries[index].owns_data)
+            wem_cache->entries[index].data = NULL;
+        free(slot->data);
+        slot->data = NULL;
+        wem_cache->cached_bytes -= slot->length;
+    }
+}
+
+WemCache* open_wem_cache(const char* path, uint64_t byte_budget)
+{
+    WemCache* wem_cache = calloc(1, sizeof(WemCache));
+#ifdef _WIN32
+    wem_cache->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER file_size;
+    bool opened = wem_cache->file != INVALID_HANDLE_VALUE;
+    if (opened && !GetFileSizeEx(wem_cache->file, &file_size)) {
+        CloseHandle(wem_cache->file);
+        opened = false;
+    }
+    wem_cache->file_length = opened ? file_size.QuadPart : 0;
+#else
+    wem_cache->fd = open(path, O_RDONLY);
+    struct stat file_info;
+    bool opened = wem_cache->fd != -1;
+    if (opened && fstat(wem_cache->fd, &file_info) == -1) {
+        close(wem_cache->fd);
+        opened = false;
+    }
+    wem_cache->file_length = opened ? file_info.st_size : 0;
+#endif
+    if (!opened) {
+        eprintf("Error: Failed to open \"%s\".\n", path);
+        free(wem_cache);
+        return NULL;
+    }
+    pthread_mutex_init(&wem_cache->lock, NULL);
+    wem_cache->byte_budget = byte_budget;
+    wem_cache->lru_head = NO_SLOT;
+    wem_cache->lru_tail = NO_SLOT;
+
+    return wem_cache;
+}
+
+uint64_t wem_cache_file_length(const WemCache* wem_cache)
+{
+    return wem_cache->file_length;
+}
+
+int read_file_start(WemCache* wem_cache, MappedFile* file_start, uint64_t length)
+{
+    if (length > wem_cache->file_length)
+        return -1;
+    if (length <= file_start->length)
+        return 0;
+
+    file_start->data = realloc(file_start->data, length);
+    if (read_at(wem_cache, &file_start->data[file_start->length], file_start->length, length - file_start->length) == -1)
+        return -1;
+    file_start->length = length;
+
+    return 0;
+}
+
+AudioDataList* make_lazy_audio_data_list(WemCache* wem_cache, WemLocations* locations)
+{
+    // sorted like the mapped lists are, wems with the same id stay in the order of the file's index
+    sort_static_list(locations, id);
+
+    AudioDataList* audio_data_list = calloc(1, sizeof(AudioDataList));
+    initialize_static_list(audio_data_list, locations->length);
+    audio_data_list->cache = wem_cache;
+    wem_cache->entries = audio_data_list->objects;
+    wem_cache->slots = malloc(locations->length * sizeof(struct cache_slot));
+    wem_cache->entry_count = locations->length;
+    for (uint64_t i = 0; i < locations->length; i++) {
+        audio_data_list->objects[i] = (AudioData) {.id = locations->objects[i].id, .length = locations->objects[i].length};
+        wem_cache->slots[i] = (struct cache_slot) {.offset = locations->objects[i].offset, .previous = NO_SLOT, .next = NO_SLOT};
+    }
+
+    return audio_data_list;
+}
+
+uint8_t* wem_cache_acquire(WemCache* wem_cache, AudioData* audio_data)
+{
+    uint64_t index = audio_data - wem_cache->entries;
+    struct cache_slot* slot = &wem_cache->slots[index];
+
+    pthread_mutex_lock(&wem_cache->lock);
+    if (slot->data) {
+        if (slot->pins++ == 0)
+            unlink_slot(wem_cache, index);
+    }
+    if (slot->data || audio_data->owns_data) {
+        uint8_t* data = audio_data->owns_data ? audio_data->data : slot->data;
+        pthread_mutex_unlock(&wem_cache->lock);
+        return data;
+    }
+    uint64_t offset = slot->offset;
+    uint32_t length = audio_data->length;
+    pthread_mutex_unlock(&wem_cache->lock);
+
+    // read without holding the lock, so that other threads can keep using the cached wems in the meantime
+    uint8_t* data = malloc(length ? length : 1);
+    if (read_at(wem_cache, data, offset, length) == -1) {
+        eprintf("Error: Failed to read wem %u.\n", audio_data->id);
+        free(data);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&wem_cache->lock);
+    if (slot->data) { // another thread loaded it first
+        free(data);
+        if (slot->pins++ == 0)
+            unlink_slot(wem_cache, index);
+    } else {
+        slot->data = data;
+        slot->length = length;
+        slot->pins = 1;
+        wem_cache->cached_bytes += length;
+        if (!audio_data->owns_data)
+            audio_data->data = data;
+        evict_unused(wem_cache);
+    }
+    data = audio_data->owns_data ? audio_data->data : slot->data;
+    pthread_mutex_unlock(&wem_cache->lock);
+
+    return data;
+}
+
+void wem_cache_release(WemCache* wem_cache, AudioData* audio_data)
+{
+    uint64_t index = audio_data - wem_cache->entries;
+    struct cache_slot* slot = &wem_cache->slots[index];
+
+    pthread_mutex_lock(&wem_cache->lock);
+    // replaced wems are only pinned if they were loaded before, so there is nothing to release otherwise
+    if (slot->pins > 0 && --slot->pins == 0) {
+        append_slot(wem_cache, index);
+        evict_unused(wem_cache);
+    }
+    pthread_mutex_unlock(&wem_cache->lock);
+}
+
+void close_wem_cache(WemCache* wem_cache)
+{
+    if (!wem_cache)
+        return;
+
+    for (uint64_t i = 0; i < wem_cache->entry_count; i++) {
+        if (!wem_cache->entries[i].owns_data)
+            wem_cache->entries[i].data = NULL;
+        free(wem_cache->slots[i].data);
+    }
+#ifdef _WIN32
+    CloseHandle(wem_cache->file);
+#else
+    close(wem_cache->fd);
+#endif
+    pthread_mutex_destroy(&wem_cache->lock);
+    free(wem_cache->slots);
+    free(wem_cache);
+}
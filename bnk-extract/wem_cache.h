@@ -0,0 +1,40 @@
+#ifndef WEM_CACHE_H
+#define WEM_CACHE_H
+
+#include <stdint.h>
+
+#include "defs.h"
+#include "mapped_file.h"
+#include "static_list.h"
+
+// keeps only the index of an audio file around and reads wem payloads on demand.
+// At most byte_budget bytes of payloads that are not in use are kept cached, the least recently used ones are dropped first.
+typedef struct wem_cache WemCache;
+
+// where a wem is in the file it is loaded from
+struct wem_location {
+    uint32_t id;
+    uint32_t length;
+    uint64_t offset;
+};
+typedef STATIC_LIST(struct wem_location) WemLocations;
+
+// opens path to load wems from, returns NULL on failure. Nothing is read until the index of the file is asked for.
+WemCache* open_wem_cache(const char* path, uint64_t byte_budget);
+
+uint64_t wem_cache_file_length(const WemCache* wem_cache);
+
+// grows file_start, a copy of the start of the file in malloc'd memory, to length bytes. Meant for the index of the file, without its wems.
+// Returns -1 if the file is shorter or could not be read.
+int read_file_start(WemCache* wem_cache, MappedFile* file_start, uint64_t length);
+
+// a list of the wems at locations, sorted by id, that loads them from wem_cache on demand. The list takes over wem_cache.
+AudioDataList* make_lazy_audio_data_list(WemCache* wem_cache, WemLocations* locations);
+
+// both are safe to call from multiple threads at once
+uint8_t* wem_cache_acquire(WemCache* wem_cache, AudioData* audio_data);
+void wem_cache_release(WemCache* wem_cache, AudioData* audio_data);
+
+void close_wem_cache(WemCache* wem_cache);
+
+#endif
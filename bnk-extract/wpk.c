@@ -2,18 +2,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
-#include <assert.h>
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
 
 #include "defs.h"
 #include "bin.h"
 #include "extract.h"
+#include "mapped_file.h"
 #include "static_list.h"
+#include "wem_cache.h"
 
 struct WPKFileEntry {
     uint32_t data_offset;
     uint32_t data_length;
-    char* filename;
-    uint8_t* data;
+    uint32_t id;
 };
 
 struct WPKFile {
@@ -26,24 +29,73 @@ struct WPKFile {
 };
 
 
-void parse_header(FILE* wpk_file, struct WPKFile* wpkfile)
+// returns the amount of leading decimal digits in a utf-16le string of length characters.
+// Like the old getc-based reader, only the low byte of every character is looked at.
+static uint32_t count_utf16_digits(const uint8_t* string, uint32_t length)
 {
-    assert(fread(wpkfile->magic, 1, 4, wpk_file) == 4);
-    assert(memcmp(wpkfile->magic, "r3d2", 4) == 0);
-    assert(fread(&wpkfile->version, 4, 1, wpk_file) == 1);
-    assert(fread(&wpkfile->file_count, 4, 1, wpk_file) == 1);
+    uint32_t i = 0;
+#ifdef __SSE2__
+    const __m128i low_byte_mask = _mm_set1_epi16(0x00FF);
+    const __m128i digit_bias = _mm_set1_epi8(0x80 - '0');
+    const __m128i digit_limit = _mm_set1_epi8(-128 + 10);
+    for (; i + 8 <= length; i += 8) {
+        // narrow 8 characters to their low bytes, then do an unsigned "c - '0' < 10" on all of them at once
+        __m128i characters = _mm_and_si128(_mm_loadu_si128((const __m128i*) &string[2*i]), low_byte_mask);
+        __m128i low_bytes = _mm_packus_epi16(characters, characters);
+        __m128i is_digit = _mm_cmplt_epi8(_mm_add_epi8(low_bytes, digit_bias), digit_limit);
+        uint32_t non_digits = ~_mm_movemask_epi8(is_digit) & 0xFF;
+        if (non_digits)
+            return i + __builtin_ctz(non_digits);
+    }
+#endif
+    for (; i < length; i++) {
+        if ((uint8_t) (string[2*i] - '0') >= 10)
+            break;
+    }
+
+    return i;
+}
+
+// equivalent to strtoul(filename, NULL, 10) on the decoded file name, without decoding it first
+static uint32_t parse_utf16_id(const uint8_t* string, uint32_t length)
+{
+    uint32_t digit_count = count_utf16_digits(string, length);
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < digit_count; i++) {
+        id = id * 10 + (string[2*i] - '0');
+    }
+
+    return id;
+}
+
+int parse_header(const MappedFile* wpk_file, struct WPKFile* wpkfile)
+{
+    if (wpk_file->length < 12)
+        return -1;
+    memcpy(wpkfile->magic, wpk_file->data, 4);
+    if (memcmp(wpkfile->magic, "r3d2", 4) != 0)
+        return -1;
+    memcpy(&wpkfile->version, &wpk_file->data[4], 4);
+    memcpy(&wpkfile->file_count, &wpk_file->data[8], 4);
+
+    return 0;
 }
 
-void parse_offsets(FILE* wpk_file, struct WPKFile* wpkfile)
+int parse_offsets(const MappedFile* wpk_file, struct WPKFile* wpkfile)
 {
+    if (12 + (uint64_t) wpkfile->file_count * 4 > wpk_file->length)
+        return -1;
     wpkfile->offsets = malloc(wpkfile->file_count * 4);
     wpkfile->offset_amount = wpkfile->file_count;
-    assert(fread(wpkfile->offsets, 4, wpkfile->file_count, wpk_file) == wpkfile->file_count);
+    memcpy(wpkfile->offsets, &wpk_file->data[12], wpkfile->file_count * 4);
+
+    return 0;
 }
 
-void parse_data(FILE* wpk_file, struct WPKFile* wpkfile)
+// wpk_file only needs to hold the file up to the end of its last file name
+int parse_data(const MappedFile* wpk_file, uint64_t file_length, struct WPKFile* wpkfile)
 {
-    int real_file_count = 0;
+    uint32_t real_file_count = 0;
     for (uint32_t i = 0; i < wpkfile->offset_amount; i++) {
         if (wpkfile->offsets[i] != 0) // riot with their padding bytes :)
             real_file_count++;
@@ -51,65 +103,135 @@ void parse_data(FILE* wpk_file, struct WPKFile* wpkfile)
     wpkfile->file_count = real_file_count;
 
     wpkfile->wpk_file_entries = malloc(wpkfile->file_count * sizeof(struct WPKFileEntry));
-    int real_index = 0;
-    for (uint32_t i = 0; i < wpkfile->offset_amount; i++, real_index++) {
-        if (wpkfile->offsets[i] == 0) {
-            real_index--;
+    uint32_t real_index = 0;
+    for (uint32_t i = 0; i < wpkfile->offset_amount; i++) {
+        uint32_t entry_offset = wpkfile->offsets[i];
+        if (entry_offset == 0)
             continue;
-        }
-        fseek(wpk_file, wpkfile->offsets[real_index], SEEK_SET);
-
-        assert(fread(&wpkfile->wpk_file_entries[real_index].data_offset, 4, 1, wpk_file) == 1);
-        assert(fread(&wpkfile->wpk_file_entries[real_index].data_length, 4, 1, wpk_file) == 1);
-
-        int filename_size;
-        assert(fread(&filename_size, 4, 1, wpk_file) == 1);
-        wpkfile->wpk_file_entries[real_index].filename = malloc(filename_size + 1);
-        for (int j = 0; j < filename_size; j++) {
-            wpkfile->wpk_file_entries[real_index].filename[j] = getc(wpk_file);
-            fseek(wpk_file, 1, SEEK_CUR);
-        }
-        wpkfile->wpk_file_entries[real_index].filename[filename_size] = '\0';
-        dprintf("string: \"%s\"\n", wpkfile->wpk_file_entries[real_index].filename);
-
-        wpkfile->wpk_file_entries[real_index].data = malloc(wpkfile->wpk_file_entries[real_index].data_length);
-        fseek(wpk_file, wpkfile->wpk_file_entries[real_index].data_offset, SEEK_SET);
-        assert(fread(wpkfile->wpk_file_entries[real_index].data, 1, wpkfile->wpk_file_entries[real_index].data_length, wpk_file) == wpkfile->wpk_file_entries[real_index].data_length);
+        struct WPKFileEntry* entry = &wpkfile->wpk_file_entries[real_index++];
+
+        uint32_t filename_size;
+        if ((uint64_t) entry_offset + 12 > wpk_file->length)
+            return -1;
+        memcpy(&entry->data_offset, &wpk_file->data[entry_offset], 4);
+        memcpy(&entry->data_length, &wpk_file->data[entry_offset + 4], 4);
+        memcpy(&filename_size, &wpk_file->data[entry_offset + 8], 4);
+        if ((uint64_t) entry_offset + 12 + 2 * (uint64_t) filename_size > wpk_file->length)
+            return -1;
+        entry->id = parse_utf16_id(&wpk_file->data[entry_offset + 12], filename_size);
+        dprintf("id: %u\n", entry->id);
+
+        if ((uint64_t) entry->data_offset + entry->data_length > file_length)
+            return -1;
     }
+
+    return 0;
 }
 
 WemInformation* parse_wpk_file(char* wpk_path, StringHashes* string_hashes)
 {
-    FILE* wpk_file = fopen(wpk_path, "rb");
+    MappedFile* wpk_file = map_file(wpk_path);
     if (!wpk_file) {
         eprintf("Error: Failed to open \"%s\".\n", wpk_path);
         return NULL;
     }
 
-    struct WPKFile wpkfile;
-    parse_header(wpk_file, &wpkfile);
-    parse_offsets(wpk_file, &wpkfile);
-    parse_data(wpk_file, &wpkfile);
-    fclose(wpk_file);
+    struct WPKFile wpkfile = {0};
+    if (parse_header(wpk_file, &wpkfile) == -1 || parse_offsets(wpk_file, &wpkfile) == -1 || parse_data(wpk_file, wpk_file->length, &wpkfile) == -1) {
+        eprintf("Error: \"%s\" is not a valid wpk file or is truncated.\n", wpk_path);
+        free(wpkfile.offsets);
+        free(wpkfile.wpk_file_entries);
+        unmap_file(wpk_file);
+        return NULL;
+    }
 
-    WemInformation* wem_information = malloc(sizeof(WemInformation));
-    wem_information->sortedWemDataList = malloc(sizeof(AudioDataList));
+    WemInformation* wem_information = calloc(1, sizeof(WemInformation));
+    wem_information->sortedWemDataList = calloc(1, sizeof(AudioDataList));
     initialize_static_list(wem_information->sortedWemDataList, wpkfile.file_count);
+    wem_information->sortedWemDataList->source = wpk_file;
     for (uint32_t i = 0; i < wpkfile.file_count; i++) {
         wem_information->sortedWemDataList->objects[i] = (AudioData) {
-            .id = strtoul(wpkfile.wpk_file_entries[i].filename, NULL, 10),
+            .id = wpkfile.wpk_file_entries[i].id,
             .length = wpkfile.wpk_file_entries[i].data_length,
-            .data = wpkfile.wpk_file_entries[i].data
+            .data = &wpk_file->data[wpkfile.wpk_file_entries[i].data_offset],
+            .owns_data = false
         };
     }
     sort_static_list(wem_information->sortedWemDataList, id);
 
+    free(wpkfile.offsets);
+    free(wpkfile.wpk_file_entries);
+
+    wem_information->grouped_wems = group_wems(wem_information->sortedWemDataList, string_hashes);
+
+    return wem_information;
+}
+
+// reads the header, the offset table and the entries with their file names, without the wems they point to
+static int read_wpk_index(WemCache* wem_cache, MappedFile* wpk_index, struct WPKFile* wpkfile)
+{
+    if (read_file_start(wem_cache, wpk_index, 12) == -1 || parse_header(wpk_index, wpkfile) == -1)
+        return -1;
+    if (read_file_start(wem_cache, wpk_index, 12 + (uint64_t) wpkfile->file_count * 4) == -1 || parse_offsets(wpk_index, wpkfile) == -1)
+        return -1;
+
+    uint64_t entries_end = wpk_index->length;
+    for (uint32_t i = 0; i < wpkfile->offset_amount; i++) {
+        if (wpkfile->offsets[i] != 0 && (uint64_t) wpkfile->offsets[i] + 12 > entries_end)
+            entries_end = (uint64_t) wpkfile->offsets[i] + 12;
+    }
+    if (read_file_start(wem_cache, wpk_index, entries_end) == -1)
+        return -1;
+
+    uint64_t names_end = entries_end;
+    for (uint32_t i = 0; i < wpkfile->offset_amount; i++) {
+        uint32_t filename_size;
+        if (wpkfile->offsets[i] == 0)
+            continue;
+        memcpy(&filename_size, &wpk_index->data[wpkfile->offsets[i] + 8], 4);
+        if ((uint64_t) wpkfile->offsets[i] + 12 + 2 * (uint64_t) filename_size > names_end)
+            names_end = (uint64_t) wpkfile->offsets[i] + 12 + 2 * (uint64_t) filename_size;
+    }
+    if (read_file_start(wem_cache, wpk_index, names_end) == -1)
+        return -1;
+
+    return parse_data(wpk_index, wem_cache_file_length(wem_cache), wpkfile);
+}
+
+WemInformation* parse_wpk_index(char* wpk_path, StringHashes* string_hashes, uint64_t cache_size)
+{
+    WemCache* wem_cache = open_wem_cache(wpk_path, cache_size);
+    if (!wem_cache)
+        return NULL;
+
+    MappedFile wpk_index = {0};
+    struct WPKFile wpkfile = {0};
+    if (read_wpk_index(wem_cache, &wpk_index, &wpkfile) == -1) {
+        eprintf("Error: \"%s\" is not a valid wpk file or is truncated.\n", wpk_path);
+        free(wpkfile.offsets);
+        free(wpkfile.wpk_file_entries);
+        free(wpk_index.data);
+        close_wem_cache(wem_cache);
+        return NULL;
+    }
+    free(wpk_index.data);
+
+    WemLocations locations;
+    initialize_static_list(&locations, wpkfile.file_count);
     for (uint32_t i = 0; i < wpkfile.file_count; i++) {
-        free(wpkfile.wpk_file_entries[i].filename);
+        locations.objects[i] = (struct wem_location) {
+            .id = wpkfile.wpk_file_entries[i].id,
+            .length = wpkfile.wpk_file_entries[i].data_length,
+            .offset = wpkfile.wpk_file_entries[i].data_offset
+        };
     }
     free(wpkfile.offsets);
     free(wpkfile.wpk_file_entries);
 
+    WemInformation* wem_information = calloc(1, sizeof(WemInformation));
+    wem_information->sortedWemDataList = make_lazy_audio_data_list(wem_cache, &locations);
+    free(locations.objects);
+
     wem_information->grouped_wems = group_wems(wem_information->sortedWemDataList, string_hashes);
 
     return wem_information;
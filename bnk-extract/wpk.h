@@ -5,5 +5,7 @@
 #include "defs.h"
 
 WemInformation* parse_wpk_file(char* wpk_path, StringHashes* string_hashes);
+// reads only the offset table and the entries, the wems are loaded from the file on demand
+WemInformation* parse_wpk_index(char* wpk_path, StringHashes* string_hashes, uint64_t cache_size);
 
 #endif
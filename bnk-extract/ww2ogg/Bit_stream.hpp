@@ -10,24 +10,49 @@
 
 #include "errors.hpp"
 #include "crc.h"
+#include "shift_merge.h"
+#include "granule_pager.hpp"
 #include "../defs.h"
+#include "../output_sink.h"
 #include "string.h"
 #include <assert.h>
 
 // host-endian-neutral integer reading
 namespace {
-    uint32_t read_32_le(unsigned char b[4])
+    // a single unaligned load, byte swapped if the host's byte order differs
+    template <bool little_endian, typename T>
+    __attribute__((always_inline)) inline T read_int(const unsigned char* b)
     {
-        uint32_t v = 0;
-        for (int i = 3; i >= 0; i--)
+        T v;
+        memcpy(&v, b, sizeof(T));
+        if constexpr (little_endian != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__))
         {
-            v <<= 8;
-            v |= b[i];
+            if constexpr (sizeof(T) == 2)
+                v = __builtin_bswap16(v);
+            else
+                v = __builtin_bswap32(v);
         }
 
         return v;
     }
 
+    template <bool little_endian>
+    __attribute__((always_inline)) inline uint16_t read_16(const unsigned char b[2])
+    {
+        return read_int<little_endian, uint16_t>(b);
+    }
+
+    template <bool little_endian>
+    __attribute__((always_inline)) inline uint32_t read_32(const unsigned char b[4])
+    {
+        return read_int<little_endian, uint32_t>(b);
+    }
+
+    uint32_t read_32_le(const unsigned char b[4])
+    {
+        return read_32<true>(b);
+    }
+
     uint32_t read_32_le(FILE* is)
     {
         char b[4];
@@ -54,16 +79,9 @@ namespace {
         fwrite(b, 4, 1, os);
     }
 
-    uint16_t read_16_le(unsigned char b[2])
+    uint16_t read_16_le(const unsigned char b[2])
     {
-        uint16_t v = 0;
-        for (int i = 1; i >= 0; i--)
-        {
-            v <<= 8;
-            v |= b[i];
-        }
-
-        return v;
+        return read_16<true>(b);
     }
 
     uint16_t read_16_le(FILE* is)
@@ -92,16 +110,9 @@ namespace {
         fwrite(b, 2, 1, os);
     }
 
-    uint32_t read_32_be(unsigned char b[4])
+    uint32_t read_32_be(const unsigned char b[4])
     {
-        uint32_t v = 0;
-        for (int i = 0; i < 4; i++)
-        {
-            v <<= 8;
-            v |= b[i];
-        }
-
-        return v;
+        return read_32<false>(b);
     }
 
     uint32_t read_32_be(FILE *is)
@@ -130,16 +141,9 @@ namespace {
         fwrite(b, 4, 1, os);
     }
 
-    uint16_t read_16_be(unsigned char b[2])
+    uint16_t read_16_be(const unsigned char b[2])
     {
-        uint16_t v = 0;
-        for (int i = 0; i < 2; i++)
-        {
-            v <<= 8;
-            v |= b[i];
-        }
-
-        return v;
+        return read_16<false>(b);
     }
 
     uint16_t read_16_be(FILE* is)
@@ -170,35 +174,67 @@ namespace {
 
 }
 
-// using an istream, pull off individual bits with get_bit (LSB first)
+// pull off individual bits with get_bit or up to 32 at once with get_bits (LSB first).
+// Whole words are buffered, so the end of the data is only checked when refilling.
 class Bit_stream {
-    const AudioData& ad;
-    int initial_position;
+    const unsigned char* next_byte; // first byte not yet in bit_buffer
+    const unsigned char* end;
 
-    unsigned char bit_buffer;
+    // bits above bits_left are either 0 or already the right bits of the following bytes
+    uint64_t bit_buffer;
     unsigned int bits_left;
     unsigned long total_bits_read;
 
+    void refill(unsigned int bit_count) {
+        if (end - next_byte >= 8) {
+            uint64_t word;
+            memcpy(&word, next_byte, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            word = __builtin_bswap64(word);
+#endif
+            bit_buffer |= word << bits_left;
+            next_byte += (63 - bits_left) / 8;
+            bits_left |= 56;
+            return;
+        }
+
+        while (bits_left <= 56 && next_byte != end) {
+            bit_buffer |= (uint64_t) *next_byte++ << bits_left;
+            bits_left += 8;
+        }
+        if (bits_left < bit_count)
+            throw Out_of_bits();
+    }
+
 public:
     class Weird_char_size {};
-    class Out_of_bits {};
+    class Out_of_bits : public Parse_error {
+    protected:
+        inline void print_self(FILE* out) const override {
+            fprintf(out, "ran out of bits");
+        }
+    };
 
-    Bit_stream(const AudioData& _ad, int initial_position = 0) : ad(_ad), initial_position(initial_position), bit_buffer(0), bits_left(0), total_bits_read(0) {
+    Bit_stream(const AudioData& ad, int initial_position = 0) :
+        next_byte(ad.data + ((uint32_t) initial_position < ad.length ? (uint32_t) initial_position : ad.length)), end(ad.data + ad.length), bit_buffer(0), bits_left(0), total_bits_read(0) {
         if ( std::numeric_limits<unsigned char>::digits != 8)
             throw Weird_char_size();
     }
-    bool get_bit() {
-        if (bits_left == 0) {
 
-            if (initial_position + total_bits_read / 8 == ad.length)
-                throw Out_of_bits();
-            bit_buffer = ad.data[initial_position + total_bits_read / 8];
-            bits_left = 8;
+    // bit_count must not be larger than 32
+    __attribute__((always_inline)) uint32_t get_bits(unsigned int bit_count) {
+        if (bits_left < bit_count)
+            refill(bit_count);
 
-        }
-        total_bits_read++;
-        bits_left --;
-        return ( ( bit_buffer & ( 0x80 >> bits_left ) ) != 0);
+        uint32_t bits = bit_buffer & ((UINT64_C(1) << bit_count) - 1);
+        bit_buffer >>= bit_count;
+        bits_left -= bit_count;
+        total_bits_read += bit_count;
+        return bits;
+    }
+
+    bool get_bit() {
+        return get_bits(1);
     }
 
     unsigned long get_total_bits_read(void) const
@@ -207,37 +243,141 @@ public:
     }
 };
 
+// collects bits (LSB first) into ogg pages, which are written to sink
 class Bit_oggstream {
-    BinaryData& bd;
+    OutputSink& sink;
 
-    unsigned char bit_buffer;
+    // bits that don't make up a whole byte yet
+    uint64_t bit_buffer;
     unsigned int bits_stored;
 
-    enum {header_bytes = 27, max_segments = 255, segment_size = 255};
+    enum {header_bytes = 27, max_segments = 255, segment_size = 255, max_payload_bytes = segment_size * max_segments};
 
     unsigned int payload_bytes;
     bool first, continued;
-    unsigned char page_buffer[header_bytes + max_segments + segment_size * max_segments];
+    // 8 spare bytes at the end, so that whole words can be stored near the end of the payload
+    unsigned char page_buffer[header_bytes + max_segments + max_payload_bytes + 8];
     uint32_t granule;
     uint32_t seqno;
+    // if set, gets the packets instead of them being paged here
+    Granule_pager* pager;
+
+    unsigned char* payload_end(void) {
+        return &page_buffer[header_bytes + max_segments + payload_bytes];
+    }
+
+    // moves the whole bytes in bit_buffer to the page, there are never more than 7 of them
+    __attribute__((always_inline)) void store_whole_bytes(void) {
+        unsigned int byte_count = bits_stored / 8;
+        if (payload_bytes + byte_count > max_payload_bytes)
+        {
+            throw Parse_error_str("ran out of space in an Ogg packet");
+        }
+
+        uint64_t word = bit_buffer;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        memcpy(payload_end(), &word, 8);
+        payload_bytes += byte_count;
+        bit_buffer >>= byte_count * 8;
+        bits_stored -= byte_count * 8;
+    }
+
+    void write_page(bool last) {
+        unsigned int segments = (payload_bytes+segment_size)/segment_size;  // intentionally round up
+        if (segments == max_segments+1) segments = max_segments; // at max eschews the final 0
+
+        // move payload back
+        memmove(&page_buffer[header_bytes + segments], &page_buffer[header_bytes + max_segments], payload_bytes);
+
+        page_buffer[0] = 'O';
+        page_buffer[1] = 'g';
+        page_buffer[2] = 'g';
+        page_buffer[3] = 'S';
+        page_buffer[4] = 0; // stream_structure_version
+        page_buffer[5] = (continued?1:0) | (first?2:0) | (last?4:0); // header_type_flag
+        write_32_le(&page_buffer[6], granule);  // granule low bits
+        write_32_le(&page_buffer[10], 0);       // granule high bits
+        if (granule == UINT32_C(0xFFFFFFFF))
+            write_32_le(&page_buffer[10], UINT32_C(0xFFFFFFFF));
+        write_32_le(&page_buffer[14], 1);       // stream serial number
+        write_32_le(&page_buffer[18], seqno);   // page sequence number
+        write_32_le(&page_buffer[22], 0);       // checksum (0 for now)
+        page_buffer[26] = segments;             // segment count
+
+        // lacing values
+        for (unsigned int i = 0, bytes_left = payload_bytes; i < segments; i++)
+        {
+            if (bytes_left >= segment_size)
+            {
+                bytes_left -= segment_size;
+                page_buffer[27 + i] = segment_size;
+            }
+            else
+            {
+                page_buffer[27 + i] = bytes_left;
+            }
+        }
+
+        // checksum
+        write_32_le(&page_buffer[22],
+                checksum(page_buffer, header_bytes + segments + payload_bytes)
+                );
+
+        append_output(&sink, page_buffer, header_bytes + segments + payload_bytes);
+    }
 
 public:
     class Weird_char_size {};
 
-    Bit_oggstream(BinaryData& _bd) :
-        bd(_bd), bit_buffer(0), bits_stored(0), payload_bytes(0), first(true), continued(false), granule(0), seqno(0) {
+    // a stream starting at a later page than the first gets first_seqno, for writing the pages of one file in parts
+    Bit_oggstream(OutputSink& _sink, Granule_pager* _pager = NULL, uint32_t first_seqno = 0) :
+        sink(_sink), bit_buffer(0), bits_stored(0), payload_bytes(0), first(first_seqno == 0), continued(false), granule(0), seqno(first_seqno), pager(_pager) {
         if ( std::numeric_limits<unsigned char>::digits != 8)
             throw Weird_char_size();
         }
 
+    // bit_count must not be larger than 64
+    __attribute__((always_inline)) void put_bits(uint64_t bits, unsigned int bit_count) {
+        if (bit_count > 56)
+        {
+            put_bits(bits & 0xFFFFFFFF, 32);
+            bits >>= 32;
+            bit_count -= 32;
+        }
+
+        bit_buffer |= bits << bits_stored;
+        bits_stored += bit_count;
+        if (bits_stored >= 8)
+            store_whole_bytes();
+    }
+
     void put_bit(bool bit) {
-        if (bit)
-        bit_buffer |= 1<<bits_stored;
+        put_bits(bit, 1);
+    }
 
-        bits_stored ++;
-        if (bits_stored == 8) {
-            flush_bits();
+    // same as putting every byte with put_bits(byte, 8)
+    void put_bytes(const unsigned char* bytes, size_t length) {
+        if (payload_bytes + length > max_payload_bytes)
+        {
+            throw Parse_error_str("ran out of space in an Ogg packet");
         }
+
+        // after storing, fewer than 8 bits are left in bit_buffer
+        if (bits_stored == 0)
+        {
+            memcpy(payload_end(), bytes, length);
+        }
+        else
+        {
+            bit_buffer = shift_merge_bytes(payload_end(), bytes, length, bits_stored, bit_buffer);
+        }
+        payload_bytes += length;
+    }
+
+    uint32_t get_seqno(void) const {
+        return seqno;
     }
 
     void set_granule(uint32_t g) {
@@ -246,75 +386,38 @@ public:
 
     void flush_bits(void) {
         if (bits_stored != 0) {
-            if (payload_bytes == segment_size * max_segments)
-            {
-                throw Parse_error_str("ran out of space in an Ogg packet");
-                flush_page(true);
-            }
-
-            page_buffer[header_bytes + max_segments + payload_bytes] = bit_buffer;
-            payload_bytes ++;
-
-            bits_stored = 0;
-            bit_buffer = 0;
+            // pads the last byte with zeroes
+            bits_stored = 8;
+            store_whole_bytes();
         }
     }
 
+    // the packet written to the current page so far, padded to whole bytes
+    void copy_payload(std::vector<unsigned char>& payload) {
+        flush_bits();
+        payload.assign(&page_buffer[header_bytes + max_segments], payload_end());
+    }
+
     void flush_page(bool next_continued=false, bool last=false) {
-        if (payload_bytes != segment_size * max_segments)
+        if (payload_bytes != max_payload_bytes)
         {
             flush_bits();
         }
 
         if (payload_bytes != 0)
         {
-            unsigned int segments = (payload_bytes+segment_size)/segment_size;  // intentionally round up
-            if (segments == max_segments+1) segments = max_segments; // at max eschews the final 0
-
-            // move payload back
-            for (unsigned int i = 0; i < payload_bytes; i++)
+            if (pager)
             {
-                page_buffer[header_bytes + segments + i] = page_buffer[header_bytes + max_segments + i];
+                // the page would only be read back by revorb, so its payload goes straight to the pager
+                if (next_continued)
+                    pager->set_repage_needed();
+                pager->add_page(&page_buffer[header_bytes + max_segments], payload_bytes, payload_bytes != max_payload_bytes, granule, last);
             }
-
-            page_buffer[0] = 'O';
-            page_buffer[1] = 'g';
-            page_buffer[2] = 'g';
-            page_buffer[3] = 'S';
-            page_buffer[4] = 0; // stream_structure_version
-            page_buffer[5] = (continued?1:0) | (first?2:0) | (last?4:0); // header_type_flag
-            write_32_le(&page_buffer[6], granule);  // granule low bits
-            write_32_le(&page_buffer[10], 0);       // granule high bits
-            if (granule == UINT32_C(0xFFFFFFFF))
-                write_32_le(&page_buffer[10], UINT32_C(0xFFFFFFFF));
-            write_32_le(&page_buffer[14], 1);       // stream serial number
-            write_32_le(&page_buffer[18], seqno);   // page sequence number
-            write_32_le(&page_buffer[22], 0);       // checksum (0 for now)
-            page_buffer[26] = segments;             // segment count
-
-            // lacing values
-            for (unsigned int i = 0, bytes_left = payload_bytes; i < segments; i++)
+            else
             {
-                if (bytes_left >= segment_size)
-                {
-                    bytes_left -= segment_size;
-                    page_buffer[27 + i] = segment_size;
-                }
-                else
-                {
-                    page_buffer[27 + i] = bytes_left;
-                }
+                write_page(last);
             }
 
-            // checksum
-            write_32_le(&page_buffer[22],
-                    checksum(page_buffer, header_bytes + segments + payload_bytes)
-                    );
-
-            bd.data = (uint8_t*) realloc(bd.data, bd.length + header_bytes + segments + payload_bytes);
-            memcpy(&bd.data[bd.length], page_buffer, header_bytes + segments + payload_bytes);
-            bd.length += header_bytes + segments + payload_bytes;
-
             seqno++;
             first = false;
             continued = next_continued;
@@ -359,17 +462,12 @@ public:
     operator unsigned int() const { return total; }
 
     __attribute__((always_inline)) friend Bit_stream& operator >> (Bit_stream& bstream, Bit_uint& bui) {
-        bui.total = 0;
-        for ( unsigned int i = 0; i < BIT_SIZE; i++) {
-            if ( bstream.get_bit() ) bui.total |= (1U << i);
-        }
+        bui.total = bstream.get_bits(BIT_SIZE);
         return bstream;
     }
 
     __attribute__((always_inline)) friend Bit_oggstream& operator << (Bit_oggstream& bstream, const Bit_uint& bui) {
-        for ( unsigned int i = 0; i < BIT_SIZE; i++) {
-            bstream.put_bit((bui.total & (1U << i)) != 0);
-        }
+        bstream.put_bits(bui.total, BIT_SIZE);
         return bstream;
     }
 };
@@ -405,17 +503,12 @@ public:
     operator unsigned int() const { return total; }
 
     __attribute__((always_inline)) friend Bit_stream& operator >> (Bit_stream& bstream, Bit_uintv& bui) {
-        bui.total = 0;
-        for ( unsigned int i = 0; i < bui.size; i++) {
-            if ( bstream.get_bit() ) bui.total |= (1U << i);
-        }
+        bui.total = bstream.get_bits(bui.size);
         return bstream;
     }
 
     __attribute__((always_inline)) friend Bit_oggstream& operator << (Bit_oggstream& bstream, const Bit_uintv& bui) {
-        for ( unsigned int i = 0; i < bui.size; i++) {
-            bstream.put_bit((bui.total & (1U << i)) != 0);
-        }
+        bstream.put_bits(bui.total, bui.size);
         return bstream;
     }
 };
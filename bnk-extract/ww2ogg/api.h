@@ -1,3 +1,63 @@
+#ifndef WW2OGG_API_H
+#define WW2OGG_API_H
+
 #include "../defs.h"
+#include "../output_sink.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum ww2ogg_packet_format {
+    WW2OGG_DETECT_PACKET_FORMAT,
+    WW2OGG_MOD_PACKETS,
+    WW2OGG_NO_MOD_PACKETS
+};
+
+// the zero-initialized struct gives the default behaviour
+struct ww2ogg_options {
+    bool inline_codebooks;
+    bool full_setup; // implies inline_codebooks
+    enum ww2ogg_packet_format packet_format;
+    bool recompute_granules; // gives what revorb would make of the ogg, without generating and reading back the ogg in between
+    const char* codebooks_filename; // a packed codebooks file to use instead of the built-in codebooks. It is mapped once and stays mapped.
+    uint32_t thread_count; // long wems are split into parts converted on up to this many threads, 0 or 1 converts on the calling thread only
+};
+
+// appends the converted ogg (or a wav, for pcm wems) to output. Returns -1 if the wem could not be parsed, output is left as it was then.
+int ww2ogg_convert(const AudioData* input, const struct ww2ogg_options* options, BinaryData* output);
+
+// the same, writing the ogg to output as it is made. On failure only memory sinks are left as they were, the others may have been written to.
+int ww2ogg_convert_to_sink(const AudioData* input, const struct ww2ogg_options* options, OutputSink* output);
+
+// where the audio packets of a wem are, to get its duration or seek in it without converting it
+struct ww2ogg_packet_table {
+    uint32_t sample_count;
+    uint32_t sample_rate;
+    uint32_t packet_count;
+    uint32_t* offsets; // of the packets' payloads in the wem
+    uint32_t* sizes;
+    uint32_t* granules; // as stored in the wem, 0 for wems without granules
+};
 
+// returns -1 if the wem could not be parsed or holds wav data
+int ww2ogg_scan_packets(const AudioData* input, const struct ww2ogg_options* options, struct ww2ogg_packet_table* table);
+
+void ww2ogg_free_packet_table(struct ww2ogg_packet_table* table);
+
+// how often a wem's setup header could be taken from an earlier wem with the same setup instead of being rebuilt, over all conversions so far
+struct ww2ogg_setup_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+void ww2ogg_get_setup_cache_stats(struct ww2ogg_setup_cache_stats* stats);
+
+// call like a main(), "--audiodata <hex pointer to an AudioData>" selects the input
 BinaryData* ww2ogg(int argc, char** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
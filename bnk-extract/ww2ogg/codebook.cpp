@@ -1,55 +1,84 @@
 #define __STDC_CONSTANT_MACROS
 #include "codebook.hpp"
+#include "codebook.bin"
 #include <cstring>
+#include <map>
+#include <memory>
+#include <pthread.h>
 #include "../defs.h"
 #include <assert.h>
 
 codebook_library::codebook_library(void)
-    : codebook_data(NULL), codebook_offsets(NULL), codebook_count(0)
+    : codebook_data(NULL), codebook_offsets(NULL), codebook_count(0), mapped_file(NULL)
 { }
 
-codebook_library::codebook_library(unsigned char* data, int length)
-    : codebook_data(NULL), codebook_offsets(NULL), codebook_count(0)
+codebook_library::codebook_library(const unsigned char* data, long length)
+    : codebook_data(NULL), codebook_offsets(NULL), codebook_count(0), mapped_file(NULL)
 {
-    int offset_offset = read_32_le(&data[length - 4]);
-    codebook_count = (length - offset_offset) / 4;
+    parse(data, length);
+}
+
+codebook_library::codebook_library(const string& filename)
+    : codebook_data(NULL), codebook_offsets(NULL), codebook_count(0), mapped_file(NULL)
+{
+    mapped_file = map_file(filename.c_str());
 
-    codebook_data = new char[offset_offset];
-    codebook_offsets = new uint32_t[codebook_count];
+    if (!mapped_file) throw File_open_error(filename);
 
-    memcpy(codebook_data, data, offset_offset);
-    memcpy(codebook_offsets, &data[offset_offset], codebook_count * 4);
+    parse(mapped_file->data, mapped_file->length);
 }
 
-codebook_library::codebook_library(const string& filename)
-    : codebook_data(NULL), codebook_offsets(NULL), codebook_count(0)
+// the offset table follows the codebooks, its own offset is the last 4 bytes
+void codebook_library::parse(const unsigned char* data, long length)
 {
-    FILE* is = fopen(filename.c_str(), "rb");
+    if (length < 4) throw Parse_error_str("packed codebooks too short");
 
-    if (!is) throw File_open_error(filename);
+    long offset_offset = read_32_le(&data[length - 4]);
+    if (offset_offset > length - 4) throw Parse_error_str("invalid packed codebooks offset table");
 
-    fseek(is, 0, SEEK_END);
-    long file_size = ftell(is);
+    codebook_data = data;
+    codebook_offsets = &data[offset_offset];
+    codebook_count = (length - offset_offset) / 4;
 
-    fseek(is, file_size - 4, SEEK_SET);
-    long offset_offset = read_32_le(is);
-    codebook_count = (file_size - offset_offset) / 4;
+    // checked once here, so that looking up a codebook can't read past the data
+    for (int i = 0; i < codebook_count - 1; i++)
+    {
+        if (get_codebook_offset(i) > get_codebook_offset(i+1) || get_codebook_offset(i+1) > (uint32_t) offset_offset)
+            throw Parse_error_str("invalid packed codebooks offset table");
+    }
+}
 
-    codebook_data = new char [offset_offset];
-    codebook_offsets = new uint32_t [codebook_count];
+const codebook_library& codebook_library::builtin(void)
+{
+    static const codebook_library library((const unsigned char*) main_codebook, 74387);
+    return library;
+}
 
-    fseek(is, 0, SEEK_SET);
-    assert(fread(codebook_data, 1, offset_offset, is) == (size_t) offset_offset);
+const codebook_library& codebook_library::from_file(const string& filename)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static map<string, unique_ptr<codebook_library>> libraries;
 
-    for (long i = 0; i < codebook_count; i++)
+    pthread_mutex_lock(&lock);
+    auto library = libraries.find(filename);
+    if (library == libraries.end())
     {
-        codebook_offsets[i] = read_32_le(is);
+        try
+        {
+            library = libraries.emplace(filename, unique_ptr<codebook_library>(new codebook_library(filename))).first;
+        }
+        catch (...)
+        {
+            pthread_mutex_unlock(&lock);
+            throw;
+        }
     }
+    pthread_mutex_unlock(&lock);
 
-    fclose(is);
+    return *library->second;
 }
 
-void codebook_library::rebuild(int i, Bit_oggstream& bos)
+void codebook_library::rebuild(int i, Bit_oggstream& bos) const
 {
     const char * cb = get_codebook(i);
     unsigned long cb_size;
@@ -69,7 +98,7 @@ void codebook_library::rebuild(int i, Bit_oggstream& bos)
 }
 
 /* cb_size == 0 to not check size (for an inline bitstream) */
-void codebook_library::copy(Bit_stream &bis, Bit_oggstream& bos)
+void codebook_library::copy(Bit_stream &bis, Bit_oggstream& bos) const
 {
     /* IN: 24 bit identifier, 16 bit dimensions, 24 bit entry count */
 
@@ -202,7 +231,7 @@ void codebook_library::copy(Bit_stream &bis, Bit_oggstream& bos)
 }
 
 /* cb_size == 0 to not check size (for an inline bitstream) */
-void codebook_library::rebuild(Bit_stream &bis, unsigned long cb_size, Bit_oggstream& bos)
+void codebook_library::rebuild(Bit_stream &bis, unsigned long cb_size, Bit_oggstream& bos) const
 {
     /* IN: 4 bit dimensions, 14 bit entry count */
 
@@ -6,6 +6,7 @@
 #include <cstdlib>
 #include "errors.hpp"
 #include "Bit_stream.hpp"
+#include "../mapped_file.h"
 
 using namespace std;
 
@@ -47,27 +48,38 @@ unsigned int _book_maptype1_quantvals(unsigned int entries, unsigned int dimensi
 
 }
 
+// packed codebooks, read in place from the built-in data or a mapped file and never written to,
+// so a single library serves all conversions at once
 class codebook_library
 {
-    char * codebook_data;
-    uint32_t * codebook_offsets;
+    const unsigned char * codebook_data;
+    const unsigned char * codebook_offsets; // little endian, codebook_count of them
     int codebook_count;
+    MappedFile * mapped_file;
 
     // Intentionally undefined
     codebook_library& operator=(const codebook_library& rhs);
     codebook_library(const codebook_library& rhs);
 
+    void parse(const unsigned char* data, long length);
+
 public:
-    codebook_library(unsigned char* data, int length);
+    // data has to outlive the library
+    codebook_library(const unsigned char* data, long length);
     codebook_library(const string& filename);
     codebook_library(void);
 
     ~codebook_library()
     {
-        delete [] codebook_data;
-        delete [] codebook_offsets;
+        unmap_file(mapped_file);
     }
 
+    // the codebooks built into ww2ogg
+    static const codebook_library& builtin(void);
+
+    // a packed codebooks file, mapped on first use and kept for all later conversions
+    static const codebook_library& from_file(const string& filename);
+
     const char * get_codebook(int i) const
     {
         if (!codebook_data || !codebook_offsets)
@@ -75,7 +87,7 @@ public:
             throw Parse_error_str("codebook library not loaded");
         }
         if (i >= codebook_count-1 || i < 0) return NULL;
-        return &codebook_data[codebook_offsets[i]];
+        return (const char *) &codebook_data[get_codebook_offset(i)];
     }
 
     long get_codebook_size(int i) const
@@ -85,13 +97,18 @@ public:
             throw Parse_error_str("codebook library not loaded");
         }
         if (i >= codebook_count-1 || i < 0) return -1;
-        return codebook_offsets[i+1]-codebook_offsets[i];
+        return get_codebook_offset(i+1)-get_codebook_offset(i);
+    }
+
+    uint32_t get_codebook_offset(int i) const
+    {
+        return read_32_le(&codebook_offsets[i * 4]);
     }
 
-    void rebuild(int i, Bit_oggstream& bos);
+    void rebuild(int i, Bit_oggstream& bos) const;
 
-    void rebuild(Bit_stream &bis, unsigned long cb_size, Bit_oggstream& bos);
+    void rebuild(Bit_stream &bis, unsigned long cb_size, Bit_oggstream& bos) const;
 
-    void copy(Bit_stream &bis, Bit_oggstream& bos);
+    void copy(Bit_stream &bis, Bit_oggstream& bos) const;
 };
 #endif
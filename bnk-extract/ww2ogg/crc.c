@@ -1,6 +1,13 @@
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#   include <immintrin.h>
+#endif
 #include "crc.h"
 
+#define OGG_CRC_POLYNOMIAL 0x04c11db7
+
 /* from Tremor (lowmem) */
 static uint32_t crc_lookup[256]={
   0x00000000,0x04c11db7,0x09823b6e,0x0d4326d9,
@@ -68,12 +75,159 @@ static uint32_t crc_lookup[256]={
   0xafb010b1,0xab710d06,0xa6322bdf,0xa2f33668,
   0xbcb4666d,0xb8757bda,0xb5365d03,0xb1f740b4};
 
-uint32_t checksum(unsigned char *data, int bytes){
-  uint32_t crc_reg=0;
-  int i;
+// crc_slices[k][b] is the checksum of byte b followed by k zero bytes, crc_slices[0] is crc_lookup
+static uint32_t crc_slices[8][256];
+
+// multiplies two polynomials modulo the ogg polynomial
+static uint32_t multiply_modulo(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (int i = 31; i >= 0; i--) {
+        product = (product << 1) ^ (product & 0x80000000 ? OGG_CRC_POLYNOMIAL : 0);
+        if (b >> i & 1)
+            product ^= a;
+    }
+
+    return product;
+}
+
+// x^n modulo the ogg polynomial
+static uint32_t x_power_modulo(uint64_t n)
+{
+    uint32_t result = 1, square = 2; // 1 and x
+    for (; n; n >>= 1) {
+        if (n & 1)
+            result = multiply_modulo(result, square);
+        square = multiply_modulo(square, square);
+    }
+
+    return result;
+}
+
+#if defined(__x86_64__)
+static struct {
+    __m128i fold_64_bytes; // x^(512+64) and x^512
+    __m128i fold_16_bytes; // x^(128+64) and x^128
+    uint64_t x96, x64; // for reducing 128 to 64 bits
+    uint64_t barrett_mu; // x^64 / polynomial
+} fold_constants;
+
+__attribute__((target("pclmul,ssse3")))
+static __m128i fold(__m128i bits, __m128i constants, __m128i next)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(bits, constants, 0x01), _mm_clmulepi64_si128(bits, constants, 0x10)), next);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static __m128i load_block(const unsigned char* data)
+{
+    // the first byte holds the highest powers of x
+    const __m128i reverse_bytes = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) data), reverse_bytes);
+}
+
+// length must be a multiple of 16 and at least 64
+__attribute__((target("pclmul,ssse3")))
+static uint32_t checksum_pclmul(uint32_t crc, const unsigned char* data, size_t length)
+{
+    __m128i blocks[4];
+    for (int i = 0; i < 4; i++) {
+        blocks[i] = load_block(&data[16 * i]);
+    }
+    blocks[0] = _mm_xor_si128(blocks[0], _mm_set_epi32(crc, 0, 0, 0));
+    size_t position = 64;
+    for (; position + 64 <= length; position += 64) {
+        for (int i = 0; i < 4; i++) {
+            blocks[i] = fold(blocks[i], fold_constants.fold_64_bytes, load_block(&data[position + 16 * i]));
+        }
+    }
+    __m128i bits = blocks[0];
+    for (int i = 1; i < 4; i++) {
+        bits = fold(bits, fold_constants.fold_16_bytes, blocks[i]);
+    }
+    for (; position < length; position += 16) {
+        bits = fold(bits, fold_constants.fold_16_bytes, load_block(&data[position]));
+    }
+
+    // the checksum is bits * x^32 modulo the polynomial, first bring bits * x^32 down to 64 bits
+    uint64_t high = (uint64_t) _mm_cvtsi128_si64(_mm_srli_si128(bits, 8));
+    uint64_t low = (uint64_t) _mm_cvtsi128_si64(bits);
+    __m128i reduced = _mm_xor_si128(_mm_clmulepi64_si128(_mm_cvtsi64_si128(high), _mm_cvtsi64_si128(fold_constants.x96), 0x00), _mm_set_epi64x(low >> 32, low << 32));
+    high = (uint64_t) _mm_cvtsi128_si64(_mm_srli_si128(reduced, 8));
+    low = (uint64_t) _mm_cvtsi128_si64(reduced);
+    uint64_t remainder = (uint64_t) _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi64_si128(high), _mm_cvtsi64_si128(fold_constants.x64), 0x00)) ^ low;
 
-  for(i=0;i<bytes;++i)
-      crc_reg=(crc_reg<<8)^crc_lookup[((crc_reg >> 24)&0xff)^data[i]];
+    // barrett reduction of the remaining 64 bits
+    uint64_t quotient = (uint64_t) _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi64_si128(remainder >> 32), _mm_cvtsi64_si128(fold_constants.barrett_mu), 0x00)) >> 32;
+    uint64_t multiple = (uint64_t) _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi64_si128(quotient), _mm_cvtsi64_si128(OGG_CRC_POLYNOMIAL | UINT64_C(0x100000000)), 0x00));
 
-  return crc_reg;
+    return (uint32_t) (remainder ^ multiple);
+}
+#endif
+
+__attribute__((constructor))
+static void initialize_crc_tables(void)
+{
+    memcpy(crc_slices[0], crc_lookup, sizeof(crc_lookup));
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint32_t previous = crc_slices[k - 1][b];
+            crc_slices[k][b] = (previous << 8) ^ crc_lookup[previous >> 24];
+        }
+    }
+
+#if defined(__x86_64__)
+    fold_constants.fold_64_bytes = _mm_set_epi64x(x_power_modulo(512), x_power_modulo(512 + 64));
+    fold_constants.fold_16_bytes = _mm_set_epi64x(x_power_modulo(128), x_power_modulo(128 + 64));
+    fold_constants.x96 = x_power_modulo(96);
+    fold_constants.x64 = x_power_modulo(64);
+    // long division of x^64 by the polynomial, the quotient has 33 bits
+    uint64_t remainder = 0, quotient = 0;
+    for (int i = 64; i >= 0; i--) {
+        remainder = remainder << 1 | (i == 64);
+        quotient <<= 1;
+        if (remainder >> 32 & 1) {
+            remainder ^= OGG_CRC_POLYNOMIAL | UINT64_C(0x100000000);
+            quotient |= 1;
+        }
+    }
+    fold_constants.barrett_mu = quotient;
+#endif
+}
+
+static uint32_t checksum_sliced(uint32_t crc, const unsigned char* data, size_t length)
+{
+    for (; length >= 8; data += 8, length -= 8) {
+        crc ^= (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+        crc = crc_slices[7][crc >> 24] ^ crc_slices[6][crc >> 16 & 0xff] ^ crc_slices[5][crc >> 8 & 0xff] ^ crc_slices[4][crc & 0xff]
+            ^ crc_slices[3][data[4]] ^ crc_slices[2][data[5]] ^ crc_slices[1][data[6]] ^ crc_slices[0][data[7]];
+    }
+    for (; length > 0; data++, length--) {
+        crc = (crc << 8) ^ crc_lookup[(crc >> 24) ^ *data];
+    }
+
+    return crc;
+}
+
+uint32_t checksum_update(uint32_t crc, const unsigned char* data, size_t length)
+{
+#if defined(__x86_64__)
+    if (length >= 64 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+        size_t folded_length = length & ~(size_t) 15;
+        crc = checksum_pclmul(crc, data, folded_length);
+        data += folded_length;
+        length -= folded_length;
+    }
+#endif
+
+    return checksum_sliced(crc, data, length);
+}
+
+uint32_t checksum_combine(uint32_t first, uint32_t second, size_t second_length)
+{
+    return multiply_modulo(first, x_power_modulo(8 * (uint64_t) second_length)) ^ second;
+}
+
+uint32_t checksum(unsigned char *data, int bytes){
+  return checksum_update(0, data, bytes);
 }
@@ -1,14 +1,22 @@
 #ifndef _CRC_H
 #define _CRC_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// ogg page checksum: crc-32 with polynomial 0x04c11db7, not reflected, starting at 0 and without a final xor
 uint32_t checksum(unsigned char *data, int bytes);
 
+// continues a checksum of previous data with the next length bytes
+uint32_t checksum_update(uint32_t crc, const unsigned char* data, size_t length);
+
+// the checksum of two pieces of data in a row, from the checksums of both pieces
+uint32_t checksum_combine(uint32_t first, uint32_t second, size_t second_length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,115 @@
+#include <cstring>
+#include "granule_pager.hpp"
+
+Granule_pager::Granule_pager(OutputSink& _sink) :
+    sink(_sink), modes(&info), packet_count(0), granule(0), last_blocksize(0), failed(false), finished(false), repage_needed(false)
+{
+    // ww2ogg's pages always have serial number 1, which revorb takes over
+    ogg_stream_init(&stream, 1);
+    vorbis_info_init(&info);
+    vorbis_comment_init(&comment);
+}
+
+Granule_pager::Granule_pager(OutputSink& _sink, Granule_pager& headers, ogg_int64_t _granule, int _last_blocksize, long first_page) :
+    sink(_sink), modes(headers.modes), packet_count(headers.packet_count), granule(_granule), last_blocksize(_last_blocksize),
+    failed(headers.failed), finished(false), repage_needed(false)
+{
+    ogg_stream_init(&stream, 1);
+    // the first page is already written, the pages here don't start the stream
+    stream.b_o_s = 1;
+    stream.pageno = first_page;
+    vorbis_info_init(&info);
+    vorbis_comment_init(&comment);
+}
+
+Granule_pager::~Granule_pager()
+{
+    ogg_stream_clear(&stream);
+    vorbis_comment_clear(&comment);
+    vorbis_info_clear(&info);
+}
+
+void Granule_pager::write_pages(bool flush)
+{
+    ogg_page page;
+    while (flush ? ogg_stream_flush(&stream, &page) : ogg_stream_pageout(&stream, &page))
+    {
+        append_output(&sink, page.header, page.header_len);
+        append_output(&sink, page.body, page.body_len);
+    }
+}
+
+void Granule_pager::add_packet(unsigned char* data, long length, ogg_int64_t page_granule, bool last)
+{
+    ogg_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.packet = data;
+    packet.bytes = length;
+    packet.b_o_s = packet_count == 0;
+    packet.packetno = packet_count++;
+
+    if (packet.packetno < 3)
+    {
+        // like in revorb, only the identification header has to be valid.
+        // The headers still go through libvorbis, since revorb's granules follow the modes libvorbis read from them.
+        if (vorbis_synthesis_headerin(&info, &comment, &packet) < 0 && packet.packetno == 0)
+        {
+            failed = true;
+            return;
+        }
+        packet.granulepos = page_granule;
+        ogg_stream_packetin(&stream, &packet);
+        if (packet.packetno == 2)
+            write_pages(true);
+        return;
+    }
+
+    int blocksize = vorbis_packet_blocksize(modes, &packet);
+    if (last_blocksize)
+        granule += (last_blocksize + blocksize) / 4;
+    last_blocksize = blocksize;
+
+    packet.granulepos = granule;
+    packet.e_o_s = last;
+    ogg_stream_packetin(&stream, &packet);
+    // without a last packet, revorb never flushes what is left
+    write_pages(last);
+    finished = last;
+}
+
+int Granule_pager::packet_blocksize(unsigned char first_byte)
+{
+    // the packet type and the mode number are all that is read, and they fit in the first byte
+    ogg_packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.packet = &first_byte;
+    packet.bytes = 1;
+
+    return vorbis_packet_blocksize(modes, &packet);
+}
+
+void Granule_pager::add_page(unsigned char* payload, long length, bool ends_packet, ogg_int64_t page_granule, bool last)
+{
+    // revorb stops reading at the last page
+    if (failed || finished)
+        return;
+
+    if (ends_packet && partial_packet.empty())
+    {
+        add_packet(payload, length, page_granule, last);
+        return;
+    }
+
+    // a full page doesn't end its packet, libogg joins it with the start of the next page when revorb reads it back
+    partial_packet.insert(partial_packet.end(), payload, payload + length);
+    if (ends_packet)
+    {
+        add_packet(partial_packet.data(), partial_packet.size(), page_granule, last);
+        partial_packet.clear();
+    }
+    else if (last)
+    {
+        // revorb would then end on a packet it already added, read from memory libogg has reused by that point
+        repage_needed = true;
+    }
+}
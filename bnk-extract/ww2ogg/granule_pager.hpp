@@ -0,0 +1,59 @@
+#ifndef _GRANULE_PAGER_H
+#define _GRANULE_PAGER_H
+
+#include <vector>
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+#include "../output_sink.h"
+
+// Takes the pages ww2ogg would write and pages their packets the way revorb would re-page ww2ogg's ogg:
+// recomputed granule positions and several packets per page, packed by libogg with the same calls revorb makes.
+class Granule_pager {
+    OutputSink& sink;
+
+    ogg_stream_state stream;
+    vorbis_info info;
+    vorbis_comment comment;
+    // what the blocksizes of the audio packets are read with, info or that of the pager that took the headers
+    vorbis_info* modes;
+
+    ogg_int64_t packet_count;
+    ogg_int64_t granule;
+    int last_blocksize;
+    bool failed, finished, repage_needed;
+    // the start of a packet that didn't end on its page
+    std::vector<unsigned char> partial_packet;
+
+    void write_pages(bool flush);
+    void add_packet(unsigned char* data, long length, ogg_int64_t page_granule, bool last);
+
+public:
+    explicit Granule_pager(OutputSink& _sink);
+    // continues the stream of headers, after it has taken the header packets and the audio packets before the next one added here.
+    // Pages are numbered from first_page on and _granule and _last_blocksize are what they were after the packet before.
+    // Only gives the same pages as headers would if its stream had no other packets left to page than the next one.
+    Granule_pager(OutputSink& _sink, Granule_pager& headers, ogg_int64_t _granule, int _last_blocksize, long first_page);
+    ~Granule_pager();
+
+    Granule_pager(const Granule_pager&) = delete;
+    Granule_pager& operator = (const Granule_pager&) = delete;
+
+    // the payload of a page ww2ogg would have written, ends_packet is false for full pages
+    void add_page(unsigned char* payload, long length, bool ends_packet, ogg_int64_t page_granule, bool last);
+
+    // what the granules are counted in, for an audio packet starting with first_byte
+    int packet_blocksize(unsigned char first_byte);
+
+    // the lacing values of the packets added so far that aren't on a written page yet
+    long unwritten_segments(void) const { return stream.lacing_fill; }
+    long written_page_count(void) const { return stream.pageno; }
+
+    // for pages that continue onto the next one, which libogg reads differently
+    void set_repage_needed(void) { repage_needed = true; }
+
+    // the output is only what revorb would give if neither of these is set
+    bool headers_failed(void) const { return failed; }
+    bool needs_repage(void) const { return repage_needed; }
+};
+
+#endif // _GRANULE_PAGER_H
@@ -0,0 +1,76 @@
+#include <cstring>
+#include <pthread.h>
+#include "setup_cache.hpp"
+#include "api.h"
+
+using namespace std;
+
+// a bank rarely has more than a few different setups, this leaves room for the wems of several banks
+enum {max_setup_headers = 64};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// the oldest gets replaced once full
+static shared_ptr<const Setup_header> setup_headers[max_setup_headers];
+static unsigned int next_setup_header;
+static struct ww2ogg_setup_cache_stats stats;
+
+// FNV-1a
+uint64_t hash_setup_header(const Setup_header_key& key, const unsigned char* wem_setup, size_t length)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ wem_setup[i]) * UINT64_C(0x100000001b3);
+    }
+
+    return hash ^ (key.channels | key.blocksize_0_pow << 8 | key.blocksize_1_pow << 12);
+}
+
+shared_ptr<const Setup_header> find_setup_header(const Setup_header_key& key, uint64_t hash, const unsigned char* wem_setup, size_t length)
+{
+    shared_ptr<const Setup_header> found;
+
+    pthread_mutex_lock(&lock);
+    for (unsigned int i = 0; i < max_setup_headers && setup_headers[i]; i++)
+    {
+        const Setup_header& setup_header = *setup_headers[i];
+        if (setup_header.hash == hash && setup_header.key == key && setup_header.wem_setup.size() == length &&
+            memcmp(setup_header.wem_setup.data(), wem_setup, length) == 0)
+        {
+            found = setup_headers[i];
+            break;
+        }
+    }
+    if (found)
+        stats.hits++;
+    else
+        stats.misses++;
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+void add_setup_header(shared_ptr<const Setup_header> setup_header)
+{
+    pthread_mutex_lock(&lock);
+    // another thread may have rebuilt the same header in the meantime
+    for (unsigned int i = 0; i < max_setup_headers && setup_headers[i]; i++)
+    {
+        if (setup_headers[i]->hash == setup_header->hash && setup_headers[i]->key == setup_header->key &&
+            setup_headers[i]->wem_setup == setup_header->wem_setup)
+        {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+    }
+    setup_headers[next_setup_header] = setup_header;
+    next_setup_header = (next_setup_header + 1) % max_setup_headers;
+    pthread_mutex_unlock(&lock);
+}
+
+extern "C" void ww2ogg_get_setup_cache_stats(struct ww2ogg_setup_cache_stats* setup_cache_stats)
+{
+    pthread_mutex_lock(&lock);
+    *setup_cache_stats = stats;
+    pthread_mutex_unlock(&lock);
+}
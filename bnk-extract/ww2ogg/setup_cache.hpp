@@ -0,0 +1,41 @@
+#ifndef _SETUP_CACHE_H
+#define _SETUP_CACHE_H
+
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+class codebook_library;
+
+// everything besides the wem's setup packet that the rebuilt setup header depends on
+struct Setup_header_key {
+    unsigned int channels;
+    uint8_t blocksize_0_pow, blocksize_1_pow;
+    bool inline_codebooks, full_setup;
+    const codebook_library* codebooks;
+
+    bool operator == (const Setup_header_key& other) const {
+        return channels == other.channels && blocksize_0_pow == other.blocksize_0_pow && blocksize_1_pow == other.blocksize_1_pow &&
+               inline_codebooks == other.inline_codebooks && full_setup == other.full_setup && codebooks == other.codebooks;
+    }
+};
+
+// a setup header rebuilt from a wem, along with what the audio packets need from it
+struct Setup_header {
+    Setup_header_key key;
+    uint64_t hash;
+    std::vector<unsigned char> wem_setup; // the setup packet as in the wem, compared in full on lookup
+    std::vector<unsigned char> ogg_setup; // the rebuilt packet, padded to whole bytes
+    std::vector<bool> mode_blockflag; // empty for --full-setup, where the modes aren't read
+    int mode_bits;
+};
+
+uint64_t hash_setup_header(const Setup_header_key& key, const unsigned char* wem_setup, size_t length);
+
+// the setup header of an earlier wem with the same setup packet and key, or NULL.
+// Wems of the same bank mostly share their setup packet, so most conversions skip rebuilding it.
+std::shared_ptr<const Setup_header> find_setup_header(const Setup_header_key& key, uint64_t hash, const unsigned char* wem_setup, size_t length);
+
+void add_setup_header(std::shared_ptr<const Setup_header> setup_header);
+
+#endif // _SETUP_CACHE_H
@@ -0,0 +1,83 @@
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#   include <immintrin.h>
+#endif
+
+#include "shift_merge.h"
+
+// output[i] = input[i] << shift | input[i - 1] >> (8 - shift), starting at i = start
+static void shift_merge_scalar(uint8_t* output, const uint8_t* input, size_t start, size_t length, unsigned int shift)
+{
+    for (size_t i = start; i < length; i++) {
+        output[i] = (uint8_t) (input[i] << shift | input[i - 1] >> (8 - shift));
+    }
+}
+
+#ifdef __SSE2__
+static size_t shift_merge_sse2(uint8_t* output, const uint8_t* input, size_t start, size_t length, unsigned int shift)
+{
+    // there are no 8 bit shifts, so shift 16 bit lanes and mask off what crossed over from the neighbouring byte
+    const __m128i left_shift = _mm_cvtsi32_si128(shift);
+    const __m128i right_shift = _mm_cvtsi32_si128(8 - shift);
+    const __m128i high_mask = _mm_set1_epi8((char) (0xFF << shift));
+    const __m128i low_mask = _mm_set1_epi8((char) (0xFF >> (8 - shift)));
+
+    size_t i = start;
+    for (; i + 16 <= length; i += 16) {
+        __m128i current = _mm_loadu_si128((const __m128i*) &input[i]);
+        __m128i previous = _mm_loadu_si128((const __m128i*) &input[i - 1]);
+        __m128i merged = _mm_or_si128(
+            _mm_and_si128(_mm_sll_epi16(current, left_shift), high_mask),
+            _mm_and_si128(_mm_srl_epi16(previous, right_shift), low_mask)
+        );
+        _mm_storeu_si128((__m128i*) &output[i], merged);
+    }
+
+    return i;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t shift_merge_avx2(uint8_t* output, const uint8_t* input, size_t start, size_t length, unsigned int shift)
+{
+    const __m128i left_shift = _mm_cvtsi32_si128(shift);
+    const __m128i right_shift = _mm_cvtsi32_si128(8 - shift);
+    const __m256i high_mask = _mm256_set1_epi8((char) (0xFF << shift));
+    const __m256i low_mask = _mm256_set1_epi8((char) (0xFF >> (8 - shift)));
+
+    size_t i = start;
+    for (; i + 32 <= length; i += 32) {
+        __m256i current = _mm256_loadu_si256((const __m256i*) &input[i]);
+        __m256i previous = _mm256_loadu_si256((const __m256i*) &input[i - 1]);
+        __m256i merged = _mm256_or_si256(
+            _mm256_and_si256(_mm256_sll_epi16(current, left_shift), high_mask),
+            _mm256_and_si256(_mm256_srl_epi16(previous, right_shift), low_mask)
+        );
+        _mm256_storeu_si256((__m256i*) &output[i], merged);
+    }
+
+    return i;
+}
+#endif
+
+uint8_t shift_merge_bytes(uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry)
+{
+    if (length == 0)
+        return carry;
+
+    // the first byte takes its low bits from carry instead of the previous input byte
+    output[0] = (uint8_t) (input[0] << shift | carry);
+    size_t i = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        i = shift_merge_avx2(output, input, i, length, shift);
+#endif
+#ifdef __SSE2__
+    i = shift_merge_sse2(output, input, i, length, shift);
+#endif
+    shift_merge_scalar(output, input, i, length, shift);
+
+    return input[length - 1] >> (8 - shift);
+}
@@ -0,0 +1,19 @@
+#ifndef _SHIFT_MERGE_H
+#define _SHIFT_MERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// writes length bytes to output, which are input shifted left by shift (1 to 7) bits within a LSB first bit stream.
+// carry holds the shift bits that go in front of input, the last shift bits of input are returned as the new carry.
+uint8_t shift_merge_bytes(uint8_t* output, const uint8_t* input, size_t length, unsigned int shift, uint8_t carry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,14 +1,18 @@
 #define __STDC_CONSTANT_MACROS
 #include <cstring>
 #include "wwriff.hpp"
+#include "codebook.hpp"
 #include "stdint.h"
 #include "errors.hpp"
 #include "../defs.h"
 #include "../general_utils.h"
+#include "api.h"
+#include "../revorb/api.h"
 
 using namespace std;
 
-class ww2ogg_options
+// only used by the main()-like entry point, ww2ogg_convert takes a plain struct ww2ogg_options
+class ww2ogg_arguments
 {
     AudioData* in_filedata;
     string in_filename;
@@ -18,9 +22,9 @@ class ww2ogg_options
     bool full_setup;
     ForcePacketFormat force_packet_format;
 public:
-    ww2ogg_options(void) : in_filename(""),
+    ww2ogg_arguments(void) : in_filename(""),
                            out_filename(""),
-                           codebooks_filename("packed_codebooks.bin"),
+                           codebooks_filename(""),
                            inline_codebooks(false),
                            full_setup(false),
                            force_packet_format(kNoForcePacketFormat)
@@ -30,9 +34,7 @@ public:
     const string& get_in_filename(void) const {return in_filename;}
     const string& get_out_filename(void) const {return out_filename;}
     const string& get_codebooks_filename(void) const {return codebooks_filename;}
-    bool get_inline_codebooks(void) const {return inline_codebooks;}
-    bool get_full_setup(void) const {return full_setup;}
-    ForcePacketFormat get_force_packet_format(void) const {return force_packet_format;}
+    struct ww2ogg_options get_options(void) const;
 };
 
 void usage(void)
@@ -42,15 +44,151 @@ void usage(void)
             "                        [--pcb packed_codebooks.bin]\n\n");
 }
 
+// ogg pages add 27 bytes and a lacing value per packet to the wem's data, revorb leaves fewer pages.
+// External codebooks get rebuilt in full, which adds up to a few kilobytes to the setup header.
+static uint64_t expected_ogg_length(uint64_t wem_length, bool recompute_granules)
+{
+    return wem_length + (recompute_granules ? wem_length / 32 : wem_length / 4) + 4096;
+}
+
+static ForcePacketFormat get_force_packet_format(const struct ww2ogg_options* options)
+{
+    if (options->packet_format == WW2OGG_MOD_PACKETS)
+        return kForceModPackets;
+    else if (options->packet_format == WW2OGG_NO_MOD_PACKETS)
+        return kForceNoModPackets;
+    return kNoForcePacketFormat;
+}
+
+// the two passes recompute_granules saves, for the oggs the granule pager can't page like revorb does
+static int convert_with_revorb(Wwise_RIFF_Vorbis& ww, OutputSink& output, uint64_t wem_length, unsigned int thread_count)
+{
+    BinaryData raw_ogg = {};
+    OutputSink raw_sink;
+    begin_output(&raw_sink, &raw_ogg, expected_ogg_length(wem_length, false));
+    try {
+        ww.generate_ogg(raw_sink, NULL, thread_count);
+    } catch (const Parse_error&) {
+        free(raw_sink.data);
+        throw;
+    }
+    end_output(&raw_sink, &raw_ogg);
+
+    int status = revorb_convert_to_sink(&raw_ogg, &output);
+    free(raw_ogg.data);
+    return status;
+}
+
+extern "C" int ww2ogg_convert_to_sink(const AudioData* input, const struct ww2ogg_options* options, OutputSink* output)
+{
+    ForcePacketFormat force_packet_format = get_force_packet_format(options);
+    uint64_t initial_length = output->length;
+    int status = 0;
+    try {
+        bool inline_codebooks = options->inline_codebooks || options->full_setup;
+        Wwise_RIFF_Vorbis ww(*input,
+            inline_codebooks,
+            options->full_setup,
+            force_packet_format,
+            options->codebooks_filename && !inline_codebooks ? codebook_library::from_file(options->codebooks_filename) : codebook_library::builtin()
+        );
+
+        if (!options->recompute_granules)
+        {
+            ww.generate_ogg(*output, NULL, options->thread_count);
+        }
+        else
+        {
+            Granule_pager pager(*output);
+            ww.generate_ogg(*output, &pager, options->thread_count);
+            if (pager.headers_failed())
+            {
+                eprintf("Error in header, probably not a Vorbis file.\n");
+                status = -1;
+            }
+            else if (pager.needs_repage())
+            {
+                if (rewind_output(output, initial_length))
+                {
+                    status = convert_with_revorb(ww, *output, input->length, options->thread_count);
+                }
+                else
+                {
+                    eprintf("Error: The last ogg page can't be paged in a single pass, convert into memory instead.\n");
+                    status = -1;
+                }
+            }
+        }
+    } catch (const File_open_error& fe) {
+        fe.print(stderr);
+        fprintf(stderr, "\n");
+        status = -1;
+    } catch (const Parse_error& pe) {
+        pe.print(stderr);
+        status = -1;
+    }
+
+    if (status == -1)
+        rewind_output(output, initial_length);
+    return output->failed ? -1 : status;
+}
+
+extern "C" int ww2ogg_convert(const AudioData* input, const struct ww2ogg_options* options, BinaryData* output)
+{
+    OutputSink sink;
+    begin_output(&sink, output, expected_ogg_length(input->length, options->recompute_granules));
+    int status = ww2ogg_convert_to_sink(input, options, &sink);
+    end_output(&sink, output);
+
+    return status;
+}
+
+static uint32_t* copy_column(const vector<uint32_t>& column)
+{
+    uint32_t* copy = (uint32_t*) malloc(column.size() * sizeof(uint32_t));
+    memcpy(copy, column.data(), column.size() * sizeof(uint32_t));
+    return copy;
+}
+
+extern "C" int ww2ogg_scan_packets(const AudioData* input, const struct ww2ogg_options* options, struct ww2ogg_packet_table* table)
+{
+    ForcePacketFormat force_packet_format = get_force_packet_format(options);
+    try {
+        // the codebooks are never needed for the packet headers
+        Wwise_RIFF_Vorbis ww(*input, true, options->full_setup, force_packet_format, codebook_library::builtin());
+        Packet_table packets;
+        ww.scan_packets(packets);
+
+        table->sample_count = ww.get_sample_count();
+        table->sample_rate = ww.get_sample_rate();
+        table->packet_count = packets.size();
+        table->offsets = copy_column(packets.offsets);
+        table->sizes = copy_column(packets.sizes);
+        table->granules = copy_column(packets.granules);
+    } catch (const Parse_error& pe) {
+        pe.print(stderr);
+        return -1;
+    }
+
+    return 0;
+}
+
+extern "C" void ww2ogg_free_packet_table(struct ww2ogg_packet_table* table)
+{
+    free(table->offsets);
+    free(table->sizes);
+    free(table->granules);
+}
+
 extern "C" BinaryData* ww2ogg(int argc, char **argv)
 {
     // cout << "Audiokinetic Wwise RIFF/RIFX Vorbis to Ogg Vorbis converter " VERSION " by hcs" << endl << endl;
 
-    ww2ogg_options opt;
+    ww2ogg_arguments args;
 
     try
     {
-        opt.parse_args(argc, argv);
+        args.parse_args(argc, argv);
     }
     catch (const Argument_error& ae)
     {
@@ -61,18 +199,9 @@ extern "C" BinaryData* ww2ogg(int argc, char **argv)
     }
 
     BinaryData* ogg_data = (BinaryData*) calloc(1, sizeof(BinaryData));
-
-    try {
-        Wwise_RIFF_Vorbis ww(opt.get_in_filedata(),
-            opt.get_codebooks_filename(),
-            opt.get_inline_codebooks(),
-            opt.get_full_setup(),
-            opt.get_force_packet_format()
-        );
-
-        ww.generate_ogg(*ogg_data);
-    } catch (const Parse_error& pe) {
-        pe.print(stderr);
+    struct ww2ogg_options options = args.get_options();
+    if (ww2ogg_convert(&args.get_in_filedata(), &options, ogg_data) == -1) {
+        free(ogg_data->data);
         free(ogg_data);
         return NULL;
     }
@@ -80,7 +209,23 @@ extern "C" BinaryData* ww2ogg(int argc, char **argv)
     return ogg_data;
 }
 
-void ww2ogg_options::parse_args(int argc, char ** argv)
+struct ww2ogg_options ww2ogg_arguments::get_options(void) const
+{
+    struct ww2ogg_options options = {};
+    options.inline_codebooks = inline_codebooks;
+    options.full_setup = full_setup;
+    // the built-in codebooks unless --pcb was given
+    options.codebooks_filename = codebooks_filename.empty() ? NULL : codebooks_filename.c_str();
+    options.packet_format = WW2OGG_DETECT_PACKET_FORMAT;
+    if (force_packet_format == kForceModPackets)
+        options.packet_format = WW2OGG_MOD_PACKETS;
+    else if (force_packet_format == kForceNoModPackets)
+        options.packet_format = WW2OGG_NO_MOD_PACKETS;
+
+    return options;
+}
+
+void ww2ogg_arguments::parse_args(int argc, char ** argv)
 {
     bool set_input = false, set_output = false;
     for (int i = 1; i < argc; i++)
@@ -1,16 +1,21 @@
 #define __STDC_CONSTANT_MACROS
 #include <cstring>
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <pthread.h>
 #include "stdint.h"
 #include "errors.hpp"
 #include "wwriff.hpp"
 #include "Bit_stream.hpp"
 #include "codebook.hpp"
-#include "codebook.bin"
+#include "setup_cache.hpp"
 #include "../defs.h"
 
 using namespace std;
 
 /* Modern 2 or 6 byte header */
+template <bool little_endian>
 class Packet
 {
     long _offset;
@@ -18,24 +23,13 @@ class Packet
     uint32_t _absolute_granule;
     bool _no_granule;
 public:
-    Packet(const AudioData& ad, long o, bool little_endian, bool no_granule = false) : _offset(o), _size(-1), _absolute_granule(0), _no_granule(no_granule) {
+    Packet(const AudioData& ad, long o, bool no_granule = false) : _offset(o), _size(-1), _absolute_granule(0), _no_granule(no_granule) {
         // i.seekg(_offset);
 
-        if (little_endian)
+        _size = read_16<little_endian>(&ad.data[_offset]);
+        if (!_no_granule)
         {
-            _size = read_16_le(&ad.data[_offset]);
-            if (!_no_granule)
-            {
-                _absolute_granule = read_32_le(&ad.data[_offset + 2]);
-            }
-        }
-        else
-        {
-            _size = read_16_be(&ad.data[_offset]);
-            if (!_no_granule)
-            {
-                _absolute_granule = read_32_be(&ad.data[_offset + 2]);
-            }
+            _absolute_granule = read_32<little_endian>(&ad.data[_offset + 2]);
         }
     }
 
@@ -47,23 +41,16 @@ public:
 };
 
 /* Old 8 byte header */
+template <bool little_endian>
 class Packet_8
 {
     long _offset;
     uint32_t _size;
     uint32_t _absolute_granule;
 public:
-    Packet_8(const AudioData& ad, long o, bool little_endian) : _offset(o), _size(-1), _absolute_granule(0) {
-        if (little_endian)
-        {
-            _size = read_32_le(&ad.data[_offset]);
-            _absolute_granule = read_32_le(&ad.data[_offset + 4]);
-        }
-        else
-        {
-            _size = read_32_be(&ad.data[_offset]);
-            _absolute_granule = read_32_be(&ad.data[_offset + 4]);
-        }
+    Packet_8(const AudioData& ad, long o) : _offset(o), _size(-1), _absolute_granule(0) {
+        _size = read_32<little_endian>(&ad.data[_offset]);
+        _absolute_granule = read_32<little_endian>(&ad.data[_offset + 4]);
     }
 
     long header_size(void) { return 8; }
@@ -100,14 +87,13 @@ const char Vorbis_packet_header::vorbis_str[6] = {'v','o','r','b','i','s'};
 
 Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
     const AudioData& indata,
-    const string& codebooks_name,
     bool inline_codebooks,
     bool full_setup,
-    ForcePacketFormat force_packet_format
+    ForcePacketFormat force_packet_format,
+    const codebook_library& codebooks
     )
   :
     _infile_data(indata),
-    _codebooks_name(codebooks_name),
     _little_endian(true),
     _is_wav(false),
     _fmt_offset(-1),
@@ -135,16 +121,15 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
     _blocksize_1_pow(0),
     _inline_codebooks(inline_codebooks),
     _full_setup(full_setup),
+    _codebooks(codebooks),
     _header_triad_present(false),
     _old_packet_headers(false),
     _no_granule(false),
-    _mod_packets(false),
-    _read_16(NULL),
-    _read_32(NULL)
+    _mod_packets(false)
 {
     // check RIFF header
     {
-        unsigned char riff_head[4], wave_head[4];
+        unsigned char riff_head[4];
         memcpy(riff_head, _infile_data.data, 4);
 
         if (memcmp(&riff_head[0],"RIFX",4))
@@ -163,18 +148,26 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
             _little_endian = false;
         }
 
-        if (_little_endian)
-        {
-            _read_16 = read_16_le;
-            _read_32 = read_32_le;
-        }
-        else
-        {
-            _read_16 = read_16_be;
-            _read_32 = read_32_be;
-        }
+    }
 
-        _riff_size = _read_32(&_infile_data.data[4]) + 8;
+    // everything after is read with the byte order settled once
+    if (_little_endian)
+    {
+        parse_chunks<true>(force_packet_format);
+    }
+    else
+    {
+        parse_chunks<false>(force_packet_format);
+    }
+}
+
+template <bool little_endian>
+void Wwise_RIFF_Vorbis::parse_chunks(ForcePacketFormat force_packet_format)
+{
+    {
+        unsigned char wave_head[4];
+
+        _riff_size = read_32<little_endian>(&_infile_data.data[4]) + 8;
 
         if (_riff_size > _infile_data.length) {
             v_printf(1, ".?\" ");
@@ -196,7 +189,7 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
         memcpy(chunk_type, &_infile_data.data[chunk_offset], 4);
         uint32_t chunk_size;
 
-        chunk_size = _read_32(&_infile_data.data[chunk_offset + 4]);
+        chunk_size = read_32<little_endian>(&_infile_data.data[chunk_offset + 4]);
 
         if (!memcmp(chunk_type,"fmt ",4))
         {
@@ -253,20 +246,20 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
         throw Parse_error_str("bad fmt size");
     }
 
-    uint16_t codec_id = _read_16(&_infile_data.data[_fmt_offset]);
+    uint16_t codec_id = read_16<little_endian>(&_infile_data.data[_fmt_offset]);
     if ((_is_wav && codec_id != 0xFFFE) || (!_is_wav && codec_id != 0xFFFF)) throw Parse_error_str("bad codec id");
-    _channels = _read_16(&_infile_data.data[_fmt_offset + 2]);
-    _sample_rate = _read_32(&_infile_data.data[_fmt_offset + 4]);
-    _avg_bytes_per_second = _read_32(&_infile_data.data[_fmt_offset + 8]);
-    _block_align = _read_16(&_infile_data.data[_fmt_offset + 12]);
-    _bits_per_sample = _read_16(&_infile_data.data[_fmt_offset + 14]);
-    if (_fmt_size-0x12 != _read_16(&_infile_data.data[_fmt_offset + 16])) throw Parse_error_str("bad extra fmt length");
+    _channels = read_16<little_endian>(&_infile_data.data[_fmt_offset + 2]);
+    _sample_rate = read_32<little_endian>(&_infile_data.data[_fmt_offset + 4]);
+    _avg_bytes_per_second = read_32<little_endian>(&_infile_data.data[_fmt_offset + 8]);
+    _block_align = read_16<little_endian>(&_infile_data.data[_fmt_offset + 12]);
+    _bits_per_sample = read_16<little_endian>(&_infile_data.data[_fmt_offset + 14]);
+    if (_fmt_size-0x12 != read_16<little_endian>(&_infile_data.data[_fmt_offset + 16])) throw Parse_error_str("bad extra fmt length");
 
     if (_fmt_size-0x12 >= 2) {
       // read extra fmt
-      _ext_unk = _read_16(&_infile_data.data[_fmt_offset + 18]);
+      _ext_unk = read_16<little_endian>(&_infile_data.data[_fmt_offset + 18]);
       if (_fmt_size-0x12 >= 6) {
-        _subtype = _read_32(&_infile_data.data[_fmt_offset + 20]);
+        _subtype = read_32<little_endian>(&_infile_data.data[_fmt_offset + 20]);
       }
     }
 
@@ -286,7 +279,7 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
 #if 0
         if (0x1c != _cue_size) throw Parse_error_str("bad cue size");
 #endif
-        _cue_count = _read_32(&_infile_data.data[_cue_offset]);
+        _cue_count = read_32<little_endian>(&_infile_data.data[_cue_offset]);
     }
 
     // read LIST
@@ -305,12 +298,12 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
     // read smpl
     if (-1 != _smpl_offset)
     {
-        _loop_count = _read_32(&_infile_data.data[_smpl_offset + 0x1C]);
+        _loop_count = read_32<little_endian>(&_infile_data.data[_smpl_offset + 0x1C]);
 
         if (1 != _loop_count) throw Parse_error_str("expected one loop");
 
-        _loop_start = _read_32(&_infile_data.data[_smpl_offset + 0x2C]);
-        _loop_end = _read_32(&_infile_data.data[_smpl_offset + 0x30]);
+        _loop_start = read_32<little_endian>(&_infile_data.data[_smpl_offset + 0x2C]);
+        _loop_end = read_32<little_endian>(&_infile_data.data[_smpl_offset + 0x30]);
     }
 
     // read vorb
@@ -329,7 +322,7 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
             break;
     }
 
-    _sample_count = _read_32(&_infile_data.data[_vorb_offset]);
+    _sample_count = read_32<little_endian>(&_infile_data.data[_vorb_offset]);
 
     int file_pos;
     switch (_vorb_size)
@@ -340,7 +333,7 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
             _no_granule = true;
 
             // _infile.seekg(_vorb_offset + 0x4, ios::beg);
-            uint32_t mod_signal = _read_32(&_infile_data.data[_vorb_offset + 0x4]);
+            uint32_t mod_signal = read_32<little_endian>(&_infile_data.data[_vorb_offset + 0x4]);
 
             // set
             // D9     11011001
@@ -378,8 +371,8 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
         _mod_packets = true;
     }
 
-    _setup_packet_offset = _read_32(&_infile_data.data[file_pos]);
-    _first_audio_packet_offset = _read_32(&_infile_data.data[file_pos + 4]);
+    _setup_packet_offset = read_32<little_endian>(&_infile_data.data[file_pos]);
+    _first_audio_packet_offset = read_32<little_endian>(&_infile_data.data[file_pos + 4]);
 
     switch (_vorb_size)
     {
@@ -407,7 +400,7 @@ Wwise_RIFF_Vorbis::Wwise_RIFF_Vorbis(
         case 0x2A:
         case 0x32:
         case 0x34:
-            _uid = _read_32(&_infile_data.data[file_pos]);
+            _uid = read_32<little_endian>(&_infile_data.data[file_pos]);
             _blocksize_0_pow = _infile_data.data[file_pos + 4];
             _blocksize_1_pow = _infile_data.data[file_pos + 5];
             break;
@@ -494,7 +487,7 @@ void Wwise_RIFF_Vorbis::print_info(void)
     }
     else
     {
-        printf("- external codebooks (%s)\n", _codebooks_name.c_str());
+        puts("- external codebooks (built in)");
     }
 
     if (_mod_packets)
@@ -514,6 +507,7 @@ void Wwise_RIFF_Vorbis::print_info(void)
 #endif
 }
 
+template <bool little_endian>
 void Wwise_RIFF_Vorbis::generate_ogg_header(Bit_oggstream& os, bool * & mode_blockflag, int & mode_bits)
 {
     // generate identification packet
@@ -610,13 +604,45 @@ void Wwise_RIFF_Vorbis::generate_ogg_header(Bit_oggstream& os, bool * & mode_blo
 
     // generate setup packet
     {
+        Packet<little_endian> setup_packet(_infile_data, _data_offset + _setup_packet_offset, _no_granule);
+
+        if (setup_packet.granule() != 0) throw Parse_error_str("setup packet granule != 0");
+
+        // rebuilding the setup only depends on its packet and these, so an earlier wem's rebuilt setup can be reused
+        shared_ptr<Setup_header> setup_header;
+        if (setup_packet.offset() + setup_packet.size() <= (long) _infile_data.length)
+        {
+            Setup_header_key key = {_channels, _blocksize_0_pow, _blocksize_1_pow, _inline_codebooks, _full_setup, &_codebooks};
+            const unsigned char* wem_setup = &_infile_data.data[setup_packet.offset()];
+            uint64_t hash = hash_setup_header(key, wem_setup, setup_packet.size());
+
+            shared_ptr<const Setup_header> cached = find_setup_header(key, hash, wem_setup, setup_packet.size());
+            if (cached)
+            {
+                os.put_bytes(cached->ogg_setup.data(), cached->ogg_setup.size());
+                os.flush_page();
+
+                if (!cached->mode_blockflag.empty())
+                {
+                    mode_blockflag = new bool [cached->mode_blockflag.size()];
+                    copy(cached->mode_blockflag.begin(), cached->mode_blockflag.end(), mode_blockflag);
+                }
+                mode_bits = cached->mode_bits;
+
+                if (setup_packet.next_offset() != _data_offset + static_cast<long>(_first_audio_packet_offset)) throw Parse_error_str("first audio packet doesn't follow setup packet");
+                return;
+            }
+
+            setup_header = make_shared<Setup_header>();
+            setup_header->key = key;
+            setup_header->hash = hash;
+            setup_header->wem_setup.assign(wem_setup, wem_setup + setup_packet.size());
+        }
+
         Vorbis_packet_header vhead(5);
 
         os << vhead;
 
-        Packet setup_packet(_infile_data, _data_offset + _setup_packet_offset, _little_endian, _no_granule);
-
-        if (setup_packet.granule() != 0) throw Parse_error_str("setup packet granule != 0");
         Bit_stream ss(_infile_data, setup_packet.offset());
 
         // codebook count
@@ -648,8 +674,6 @@ void Wwise_RIFF_Vorbis::generate_ogg_header(Bit_oggstream& os, bool * & mode_blo
         {
             /* external codebooks */
 
-            codebook_library cbl((unsigned char*) main_codebook, 74387);
-
             for (unsigned int i = 0; i < codebook_count; i++)
             {
                 Bit_uint<10> codebook_id;
@@ -657,7 +681,7 @@ void Wwise_RIFF_Vorbis::generate_ogg_header(Bit_oggstream& os, bool * & mode_blo
                 //cout << "Codebook " << i << " = " << codebook_id << endl;
                 try
                 {
-                    cbl.rebuild(codebook_id, os);
+                    _codebooks.rebuild(codebook_id, os);
                 }
                 catch (const Invalid_id & e)
                 {
@@ -982,21 +1006,35 @@ void Wwise_RIFF_Vorbis::generate_ogg_header(Bit_oggstream& os, bool * & mode_blo
                 if (mapping >= mapping_count) throw Parse_error_str("invalid mode mapping");
             }
 
+            if (setup_header)
+            {
+                setup_header->mode_blockflag.assign(mode_blockflag, mode_blockflag + mode_count);
+            }
+
             Bit_uint<1> framing(1);
             os << framing;
 
         } // _full_setup
 
+        if (setup_header)
+        {
+            os.copy_payload(setup_header->ogg_setup);
+        }
         os.flush_page();
 
         if ((ss.get_total_bits_read()+7)/8 != setup_packet.size()) throw Parse_error_str("didn't read exactly setup packet");
 
         if (setup_packet.next_offset() != _data_offset + static_cast<long>(_first_audio_packet_offset)) throw Parse_error_str("first audio packet doesn't follow setup packet");
 
+        if (setup_header)
+        {
+            setup_header->mode_bits = mode_bits;
+            add_setup_header(setup_header);
+        }
     }
 }
 
-void Wwise_RIFF_Vorbis::generate_wav_header(BinaryData& bd)
+void Wwise_RIFF_Vorbis::generate_wav_header(OutputSink& sink)
 {
     struct wav_header {
         const char riff[4] = {'R', 'I', 'F', 'F'};
@@ -1012,7 +1050,6 @@ void Wwise_RIFF_Vorbis::generate_wav_header(BinaryData& bd)
         uint16_t bits_per_sample;
     };
     static_assert(sizeof(struct wav_header) == 36);
-    bd.data = (uint8_t*) realloc(bd.data, bd.length + 36);
     struct wav_header WavHeader = {
         .file_size = 44 + (uint32_t) _data_size,
         .channels = _channels,
@@ -1021,185 +1058,612 @@ void Wwise_RIFF_Vorbis::generate_wav_header(BinaryData& bd)
         .block_align = _block_align,
         .bits_per_sample = _bits_per_sample
     };
-    memcpy(&bd.data[bd.length], &WavHeader, sizeof(WavHeader));
-    bd.length += 36;
+    append_output(&sink, &WavHeader, sizeof(WavHeader));
+}
+
+void Wwise_RIFF_Vorbis::generate_ogg(OutputSink& outputdata, Granule_pager* pager, unsigned int thread_count)
+{
+    // one dispatch per file, so that the packet headers are read with plain loads inside the packet loop
+    if (_little_endian)
+    {
+        generate_ogg<true>(outputdata, pager, thread_count);
+    }
+    else
+    {
+        generate_ogg<false>(outputdata, pager, thread_count);
+    }
 }
 
-void Wwise_RIFF_Vorbis::generate_ogg(BinaryData& outputdata)
+template <bool little_endian>
+void Wwise_RIFF_Vorbis::generate_ogg(OutputSink& outputdata, Granule_pager* pager, unsigned int thread_count)
 {
-    Bit_oggstream os(outputdata);
+    Bit_oggstream os(outputdata, pager);
 
     bool * mode_blockflag = NULL;
     int mode_bits = 0;
-    bool prev_blockflag = false;
 
     if (_is_wav)
     {
         generate_wav_header(outputdata);
-        outputdata.data = (uint8_t*) realloc(outputdata.data, outputdata.length + 8 + _data_size);
-        memcpy(&outputdata.data[outputdata.length], "data", 4);
-        memcpy(&outputdata.data[outputdata.length + 4], &_data_size, 4);
-        memcpy(&outputdata.data[outputdata.length + 8], &_infile_data.data[_data_offset], _data_size);
-        outputdata.length += 8 + _data_size;
+        append_output(&outputdata, "data", 4);
+        append_output(&outputdata, &_data_size, 4);
+        append_output(&outputdata, &_infile_data.data[_data_offset], _data_size);
         return;
     }
     else if (_header_triad_present)
     {
-        generate_ogg_header_with_triad(os);
+        generate_ogg_header_with_triad<little_endian>(os);
     }
     else
     {
-        generate_ogg_header(os, mode_blockflag, mode_bits);
+        generate_ogg_header<little_endian>(os, mode_blockflag, mode_bits);
     }
 
     // Audio pages
     {
-        long offset = _data_offset + _first_audio_packet_offset;
+        Packet_table packets;
+        scan_packets<little_endian>(packets, mode_bits);
 
-        while (offset < _data_offset + _data_size)
+        if (!generate_audio_pages_parallel(outputdata, os, pager, packets, mode_blockflag, mode_bits, thread_count))
         {
-            uint32_t size, granule;
-            long packet_header_size, packet_payload_offset, next_offset;
+            generate_audio_pages(os, packets, 0, packets.size(), mode_blockflag, mode_bits);
+        }
+    }
 
-            if (_old_packet_headers)
+    delete [] mode_blockflag;
+}
+
+// writes the packets from begin up to end, which can start anywhere since everything carried from one packet to the next is in the table
+void Wwise_RIFF_Vorbis::generate_audio_pages(Bit_oggstream& os, const Packet_table& packets, size_t begin, size_t end, const bool* mode_blockflag, int mode_bits) const
+{
+    bool prev_blockflag = false;
+    if (_mod_packets && mode_blockflag && begin > 0)
+    {
+        prev_blockflag = mode_blockflag[packets.mode_numbers[begin - 1]];
+    }
+
+    for (size_t i = begin; i < end; i++)
+    {
+        long offset = packets.offsets[i];
+        uint32_t size = packets.sizes[i];
+        uint32_t granule = packets.granules[i];
+
+        // HACK: don't know what to do here
+        if (granule == UINT32_C(0xFFFFFFFF))
+        {
+            os.set_granule(1);
+        }
+        else
+        {
+            os.set_granule(granule);
+        }
+
+        // first byte
+        if (_mod_packets)
+        {
+            // need to rebuild packet type and window info
+
+            if (!mode_blockflag)
             {
-                Packet_8 audio_packet(_infile_data, offset, _little_endian);
-                packet_header_size = audio_packet.header_size();
-                size = audio_packet.size();
-                packet_payload_offset = audio_packet.offset();
-                granule = audio_packet.granule();
-                next_offset = audio_packet.next_offset();
+                throw Parse_error_str("didn't load mode_blockflag");
             }
-            else
+
+            // OUT: 1 bit packet type (0 == audio)
+            Bit_uint<1> packet_type(0);
+            os << packet_type;
+
+            // IN/OUT: N bit mode number (max 6 bits), collected from the first byte by the scan
+            unsigned int mode_number = packets.mode_numbers[i];
+            os.put_bits(mode_number, mode_bits);
+
+            if (mode_blockflag[mode_number])
             {
-                Packet audio_packet(_infile_data, offset, _little_endian, _no_granule);
-                packet_header_size = audio_packet.header_size();
-                size = audio_packet.size();
-                packet_payload_offset = audio_packet.offset();
-                granule = audio_packet.granule();
-                next_offset = audio_packet.next_offset();
-            }
+                // long window, the scan already has the next frame's mode
 
-            if (offset + packet_header_size > _data_offset + _data_size) {
-                throw Parse_error_str("page header truncated");
+                bool next_blockflag = false;
+                if (i + 1 < packets.size() && packets.sizes[i + 1] > 0)
+                {
+                    next_blockflag = mode_blockflag[packets.mode_numbers[i + 1]];
+                }
+
+                // OUT: previous window type bit
+                Bit_uint<1> prev_window_type(prev_blockflag);
+                os << prev_window_type;
+
+                // OUT: next window type bit
+                Bit_uint<1> next_window_type(next_blockflag);
+                os << next_window_type;
             }
 
-            offset = packet_payload_offset;
+            prev_blockflag = mode_blockflag[mode_number];
+
+            // OUT: remaining bits of first (input) byte
+            os.put_bits(_infile_data.data[offset] >> mode_bits, 8-mode_bits);
+        }
+        else
+        {
+            // nothing unusual for first byte
+            os.put_bytes(&_infile_data.data[offset], 1);
+        }
+
+        // remainder of packet
+        if (size > 1)
+        {
+            os.put_bytes(&_infile_data.data[offset + 1], size - 1);
+        }
+
+        os.flush_page( false, i + 1 == packets.size() );
+    }
+}
+
+// splitting shorter wems costs more in starting threads than it saves
+enum {min_packets_per_chunk = 1024};
+// at most what fits on one page with the rebuilt first byte, larger packets continue onto the next page, which libogg pages differently
+enum {max_chunked_packet_size = 255 * 255 - 2};
+
+// what a chunk's granule pager holds after one of its packets
+struct Chunk_position {
+    // the first lacing value that isn't on a written page yet, counted over all packets.
+    // Pagers at the same one have the same packets left to page, so they write the same pages from there on.
+    uint64_t unwritten_segment;
+    uint64_t length; // of the chunk's output so far
+    long page_count;
+};
+
+// a range of packets paged on its own thread
+struct Audio_chunk {
+    size_t begin;
+    // paged by the granule pager, a chunk goes on to the first packet of the next one, to check that their pages line up
+    size_t end;
+    // where the pages go, the first chunk writes to the output right away and the others to buffer
+    OutputSink* output;
+    OutputSink buffer;
+    Granule_pager* pager;
+    Bit_oggstream* os;
+    // for the chunks after the first, kept to page further than the chunk's thread did
+    unique_ptr<Granule_pager> own_pager;
+    unique_ptr<Bit_oggstream> own_os;
+    vector<Chunk_position> positions; // one for each packet from begin on
+    exception_ptr error;
+
+    Audio_chunk() : begin(0), end(0), output(&buffer), pager(NULL), os(NULL) {
+        BinaryData empty = {};
+        begin_output(&buffer, &empty, 0);
+    }
+    ~Audio_chunk() {
+        // the pager flushes nothing into the buffer anymore, but still has to go before it
+        own_os.reset();
+        own_pager.reset();
+        free(buffer.data);
+    }
+
+    Audio_chunk(const Audio_chunk&) = delete;
+    Audio_chunk& operator = (const Audio_chunk&) = delete;
+
+    const Chunk_position& position(size_t packet) const { return positions[packet - begin]; }
+};
+
+// what all chunks of one wem share
+struct Audio_chunks {
+    const Packet_table& packets;
+    const bool* mode_blockflag;
+    int mode_bits;
+    // the pager that took the headers, or NULL if the pages are written by ww2ogg
+    Granule_pager* pager;
+    // without a pager, the audio pages are numbered from here on
+    uint32_t first_seqno;
+    // with a pager, the granule and blocksize it has before each packet
+    vector<ogg_int64_t> granules;
+    vector<int> blocksizes;
+    // and the lacing values of all packets before each one
+    vector<uint64_t> segments;
+
+    Audio_chunks(const Packet_table& _packets, const bool* _mode_blockflag, int _mode_bits, Granule_pager* _pager, uint32_t _first_seqno) :
+        packets(_packets), mode_blockflag(_mode_blockflag), mode_bits(_mode_bits), pager(_pager), first_seqno(_first_seqno) {}
+};
+
+struct Audio_chunk_work {
+    const Wwise_RIFF_Vorbis* vorbis;
+    const Audio_chunks* audio;
+    Audio_chunk* chunk;
+    size_t end;
+};
+
+void* Wwise_RIFF_Vorbis::audio_chunk_thread(void* argument)
+{
+    Audio_chunk_work* work = static_cast<Audio_chunk_work*>(argument);
+    try
+    {
+        work->vorbis->generate_audio_chunk(*work->audio, *work->chunk, work->end);
+    }
+    catch (...)
+    {
+        work->chunk->error = current_exception();
+    }
+    return NULL;
+}
+
+// pages the packets of chunk up to end, continuing where it was left if it was paged before
+void Wwise_RIFF_Vorbis::generate_audio_chunk(const Audio_chunks& audio, Audio_chunk& chunk, size_t end) const
+{
+    if (!audio.pager)
+    {
+        generate_audio_pages(*chunk.os, audio.packets, chunk.end, end, audio.mode_blockflag, audio.mode_bits);
+        chunk.end = end;
+        return;
+    }
 
-            // HACK: don't know what to do here
-            if (granule == UINT32_C(0xFFFFFFFF))
+    for (; chunk.end < end; chunk.end++)
+    {
+        generate_audio_pages(*chunk.os, audio.packets, chunk.end, chunk.end + 1, audio.mode_blockflag, audio.mode_bits);
+        chunk.positions.push_back({
+            audio.segments[chunk.end + 1] - chunk.pager->unwritten_segments(),
+            chunk.output->length,
+            chunk.pager->written_page_count()
+        });
+    }
+}
+
+// replays how libogg's ogg_stream_pageout packs the packets into pages, which only depends on their lengths.
+// A pager can start at the packets that are all that is left to page after adding them: the stream of
+// a single pass is in the same state there as a new one that only got that packet.
+// Gives the pages written once each of those packets is added, and -1 for the others.
+static vector<long> find_pager_starts(const vector<uint32_t>& packet_lengths, const vector<uint64_t>& segments)
+{
+    vector<unsigned char> lacing_values;
+    lacing_values.reserve(segments.back());
+    for (uint32_t length : packet_lengths)
+    {
+        lacing_values.insert(lacing_values.end(), length / 255, 255);
+        lacing_values.push_back(length % 255);
+    }
+
+    vector<long> pager_starts(packet_lengths.size());
+    uint64_t unwritten = 0;
+    long page_count = 0;
+    for (size_t i = 0; i < packet_lengths.size(); i++)
+    {
+        // the same decisions as ogg_stream_flush_i, for the nominal page size of 4096 bytes
+        for (;;)
+        {
+            uint64_t max_values = min<uint64_t>(segments[i + 1] - unwritten, 255);
+            uint64_t values = 0;
+            long accumulated = 0;
+            int packets_done = 0, packet_just_done = 0;
+            bool page_full = false;
+            for (; values < max_values; values++)
             {
-                os.set_granule(1);
+                if (accumulated > 4096 && packet_just_done >= 4)
+                {
+                    page_full = true;
+                    break;
+                }
+                accumulated += lacing_values[unwritten + values];
+                if (lacing_values[unwritten + values] < 255)
+                    packet_just_done = ++packets_done;
+                else
+                    packet_just_done = 0;
             }
-            else
+            if (values == 255) page_full = true;
+            if (!page_full) break;
+
+            unwritten += values;
+            page_count++;
+        }
+        pager_starts[i] = unwritten == segments[i] ? page_count : -1;
+    }
+
+    return pager_starts;
+}
+
+// moves the pages of a chunk's pager after the pages before them.
+// The checksum is linear, so it only changes by the checksum of the changed number followed by the rest of the page.
+static void renumber_pages(unsigned char* pages, uint64_t length, uint32_t seqno_offset)
+{
+    for (uint64_t offset = 0; offset < length;)
+    {
+        unsigned char* page = &pages[offset];
+        unsigned int segments = page[26];
+        uint64_t page_length = 27 + segments;
+        for (unsigned int i = 0; i < segments; i++)
+        {
+            page_length += page[27 + i];
+        }
+
+        uint32_t seqno = read_32_le(&page[18]);
+        unsigned char seqno_change[4];
+        write_32_le(seqno_change, seqno ^ (seqno + seqno_offset));
+        uint32_t page_checksum = read_32_le(&page[22]) ^ checksum_combine(checksum(seqno_change, 4), 0, page_length - 22);
+        write_32_le(&page[18], seqno + seqno_offset);
+        write_32_le(&page[22], page_checksum);
+
+        offset += page_length;
+    }
+}
+
+// For long wems, pages the audio packets in chunks on up to thread_count threads and puts their pages together,
+// the same pages a single pass writes. Returns false if the wem isn't worth splitting, its packets are left to write then.
+// The first chunk is paged on this thread with os, the others into memory to be appended after it.
+//
+// ww2ogg writes a page per packet, so a chunk knows its page numbers from the start.
+// The granule pager's libogg stream instead packs several packets into a page, depending on where the page before ended.
+// Its chunks begin where a new pager pages the same as a single pass, which is found by replaying libogg's paging on
+// the packet lengths. Should a chunk's pager still end up with other packets left to page than the pager of the
+// chunk before, that one goes on paging on this thread until they line up, and the pages after are renumbered.
+bool Wwise_RIFF_Vorbis::generate_audio_pages_parallel(OutputSink& sink, Bit_oggstream& os, Granule_pager* pager, const Packet_table& packets,
+                                                      const bool* mode_blockflag, int mode_bits, unsigned int thread_count) const
+{
+    size_t packet_count = packets.size();
+    size_t chunk_count = min<size_t>(thread_count, packet_count / min_packets_per_chunk);
+    if (chunk_count < 2) return false;
+    // the cases a single pass throws or gives up on are left to it
+    if (_mod_packets && !mode_blockflag) return false;
+    if (pager && (pager->headers_failed() || pager->needs_repage())) return false;
+    for (size_t i = 0; i < packet_count; i++)
+    {
+        if (packets.sizes[i] > max_chunked_packet_size) return false;
+    }
+
+    vector<size_t> begins(chunk_count);
+    vector<long> first_pages(chunk_count);
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+        begins[i] = packet_count * i / chunk_count;
+    }
+
+    Audio_chunks audio(packets, mode_blockflag, mode_bits, pager, os.get_seqno());
+    if (pager)
+    {
+        // the granules only depend on the blocksizes, which are in the first byte of each packet
+        int blocksizes[256];
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            blocksizes[i] = pager->packet_blocksize(i);
+        }
+
+        audio.granules.resize(packet_count + 1);
+        audio.blocksizes.resize(packet_count);
+        audio.segments.resize(packet_count + 1);
+        vector<uint32_t> packet_lengths(packet_count);
+        ogg_int64_t granule = 0;
+        int last_blocksize = 0;
+        uint64_t segments = 0;
+        for (size_t i = 0; i < packet_count; i++)
+        {
+            audio.granules[i] = granule;
+            audio.segments[i] = segments;
+
+            int blocksize = blocksizes[_mod_packets ? packets.mode_numbers[i] << 1 : _infile_data.data[packets.offsets[i]]];
+            if (last_blocksize)
+                granule += (last_blocksize + blocksize) / 4;
+            last_blocksize = blocksize;
+            audio.blocksizes[i] = blocksize;
+
+            // every packet has at least its first byte, a mod packet gets one more for the window bits
+            packet_lengths[i] = max<uint32_t>(packets.sizes[i], 1) + (_mod_packets ? 1 : 0);
+            segments += packet_lengths[i] / 255 + 1;
+        }
+        audio.granules[packet_count] = granule;
+        audio.segments[packet_count] = segments;
+
+        // the chunks are moved to the next packet a pager can start at, those that don't have one left are dropped
+        vector<long> pager_starts = find_pager_starts(packet_lengths, audio.segments);
+        size_t pager_chunk_count = 1;
+        first_pages[0] = pager->written_page_count();
+        for (size_t i = 1; i < chunk_count; i++)
+        {
+            size_t begin = max(begins[i], begins[pager_chunk_count - 1] + 1);
+            while (begin < packet_count && pager_starts[begin] < 0)
             {
-                os.set_granule(granule);
+                begin++;
             }
-
-            // first byte
-            if (_mod_packets)
+            if (begin < packet_count)
             {
-                // need to rebuild packet type and window info
-
-                if (!mode_blockflag)
-                {
-                    throw Parse_error_str("didn't load mode_blockflag");
-                }
+                begins[pager_chunk_count] = begin;
+                first_pages[pager_chunk_count] = first_pages[0] + pager_starts[begin];
+                pager_chunk_count++;
+            }
+        }
+        chunk_count = pager_chunk_count;
+        if (chunk_count < 2) return false;
+    }
 
-                // OUT: 1 bit packet type (0 == audio)
-                Bit_uint<1> packet_type(0);
-                os << packet_type;
+    unique_ptr<Audio_chunk[]> chunks(new Audio_chunk[chunk_count]);
+    chunks[0].output = &sink;
+    chunks[0].pager = pager;
+    chunks[0].os = &os;
+    vector<Audio_chunk_work> work(chunk_count);
+    vector<pthread_t> threads(chunk_count);
+    vector<bool> started(chunk_count);
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+        Audio_chunk& chunk = chunks[i];
+        chunk.begin = begins[i];
+        chunk.end = begins[i];
+        size_t end = i + 1 < chunk_count ? begins[i + 1] : packet_count;
+        // the first packet of the next chunk shows if both pagers line up
+        if (pager && i + 1 < chunk_count)
+            end++;
+        work[i] = {this, &audio, &chunk, end};
+
+        if (i > 0)
+        {
+            // about the size of the wem's packets, the pages add a little
+            uint64_t packets_length = packets.offsets[end - 1] + packets.sizes[end - 1] - packets.offsets[chunk.begin];
+            BinaryData empty = {};
+            begin_output(&chunk.buffer, &empty, packets_length + packets_length / 16);
 
-                Bit_uintv * mode_number_p = 0;
-                Bit_uintv * remainder_p = 0;
+            // made here, since the first chunk's pager changes once the threads run
+            if (pager)
+            {
+                int last_blocksize = chunk.begin > 0 ? audio.blocksizes[chunk.begin - 1] : 0;
+                chunk.own_pager.reset(new Granule_pager(chunk.buffer, *pager, audio.granules[chunk.begin], last_blocksize, first_pages[i]));
+                chunk.pager = chunk.own_pager.get();
+            }
+            chunk.own_os.reset(new Bit_oggstream(chunk.buffer, chunk.pager, audio.first_seqno + chunk.begin));
+            chunk.os = chunk.own_os.get();
 
-                {
-                    // collect mode number from first byte
+            started[i] = pthread_create(&threads[i], NULL, audio_chunk_thread, &work[i]) == 0;
+        }
+    }
+    audio_chunk_thread(&work[0]);
+    for (size_t i = 1; i < chunk_count; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            audio_chunk_thread(&work[i]);
+    }
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+        if (chunks[i].error)
+            rethrow_exception(chunks[i].error);
+    }
 
-                    Bit_stream ss(_infile_data, offset);
+    if (!pager)
+    {
+        for (size_t i = 1; i < chunk_count; i++)
+        {
+            append_output(&sink, chunks[i].buffer.data, chunks[i].buffer.length);
+        }
+        return true;
+    }
 
-                    // IN/OUT: N bit mode number (max 6 bits)
-                    mode_number_p = new Bit_uintv(mode_bits);
-                    ss >> *mode_number_p;
-                    os << *mode_number_p;
+    // the chunk whose pages are the ones a single pass writes. Those before written_length are in the output already,
+    // the others are still off from their place by page_offset.
+    Audio_chunk* current = &chunks[0];
+    uint64_t written_length = 0;
+    long page_offset = 0;
+    size_t packet = 0;
+    for (size_t i = 1; i < chunk_count; i++)
+    {
+        Audio_chunk& next = chunks[i];
+        for (packet = max(packet, next.begin); packet < next.end; packet++)
+        {
+            if (packet >= current->end)
+                generate_audio_chunk(audio, *current, packet + 1);
+            if (current->position(packet).unwritten_segment == next.position(packet).unwritten_segment)
+                break;
+        }
+        // the next chunk never lined up with the current one, which then goes on into the chunk after
+        if (packet == next.end)
+            continue;
 
-                    // IN: remaining bits of first (input) byte
-                    remainder_p = new Bit_uintv(8-mode_bits);
-                    ss >> *remainder_p;
-                }
+        const Chunk_position& end = current->position(packet);
+        if (current != &chunks[0])
+        {
+            if (page_offset != 0)
+                renumber_pages(&current->buffer.data[written_length], end.length - written_length, page_offset);
+            append_output(&sink, &current->buffer.data[written_length], end.length - written_length);
+        }
 
-                if (mode_blockflag[*mode_number_p])
-                {
-                    // long window, peek at next frame
+        page_offset += end.page_count - next.position(packet).page_count;
+        current = &next;
+        written_length = next.position(packet).length;
+    }
 
-                    bool next_blockflag = false;
-                    if (next_offset + packet_header_size <= _data_offset + _data_size)
-                    {
+    generate_audio_chunk(audio, *current, packet_count);
+    if (current != &chunks[0])
+    {
+        if (page_offset != 0)
+            renumber_pages(&current->buffer.data[written_length], current->buffer.length - written_length, page_offset);
+        append_output(&sink, &current->buffer.data[written_length], current->buffer.length - written_length);
+    }
 
-                        // mod_packets always goes with 6-byte headers
-                        Packet audio_packet(_infile_data, next_offset, _little_endian, _no_granule);
-                        uint32_t next_packet_size = audio_packet.size();
-                        if (next_packet_size > 0)
-                        {
-                            Bit_stream ss(_infile_data, audio_packet.offset());
-                            Bit_uintv next_mode_number(mode_bits);
+    return true;
+}
 
-                            ss >> next_mode_number;
+void Wwise_RIFF_Vorbis::scan_packets(Packet_table& packets)
+{
+    if (_is_wav) throw Parse_error_str("wav data has no packets");
 
-                            next_blockflag = mode_blockflag[next_mode_number];
-                        }
-                    }
+    if (_little_endian)
+    {
+        scan_packets<true>(packets, -1);
+    }
+    else
+    {
+        scan_packets<false>(packets, -1);
+    }
+}
 
-                    // OUT: previous window type bit
-                    Bit_uint<1> prev_window_type(prev_blockflag);
-                    os << prev_window_type;
+// walks the data chunk, checking every packet header before any page gets written.
+// The mode numbers are only collected for mod packets, and not at all if mode_bits is -1.
+// A first walk only counts the packets, so that the table is allocated once however long the wem is.
+template <bool little_endian>
+void Wwise_RIFF_Vorbis::scan_packets(Packet_table& packets, int mode_bits)
+{
+    size_t packet_count = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+        {
+            packets.offsets.reserve(packet_count);
+            packets.sizes.reserve(packet_count);
+            packets.granules.reserve(packet_count);
+            if (_mod_packets && mode_bits >= 0) packets.mode_numbers.reserve(packet_count);
+        }
 
-                    // OUT: next window type bit
-                    Bit_uint<1> next_window_type(next_blockflag);
-                    os << next_window_type;
-                }
+        long offset = _data_offset + _first_audio_packet_offset;
 
-                prev_blockflag = mode_blockflag[*mode_number_p];
-                delete mode_number_p;
+        while (offset < _data_offset + _data_size)
+        {
+            uint32_t size, granule;
+            long packet_header_size, packet_payload_offset, next_offset;
 
-                // OUT: remaining bits of first (input) byte
-                os << *remainder_p;
-                delete remainder_p;
+            if (_old_packet_headers)
+            {
+                Packet_8<little_endian> audio_packet(_infile_data, offset);
+                packet_header_size = audio_packet.header_size();
+                size = audio_packet.size();
+                packet_payload_offset = audio_packet.offset();
+                granule = audio_packet.granule();
+                next_offset = audio_packet.next_offset();
             }
             else
             {
-                // nothing unusual for first byte
-                int v = _infile_data.data[offset];
-                if (v < 0)
-                {
-                    throw Parse_error_str("file truncated");
-                }
-                Bit_uint<8> c(v);
-                os << c;
+                Packet<little_endian> audio_packet(_infile_data, offset, _no_granule);
+                packet_header_size = audio_packet.header_size();
+                size = audio_packet.size();
+                packet_payload_offset = audio_packet.offset();
+                granule = audio_packet.granule();
+                next_offset = audio_packet.next_offset();
             }
 
-            // remainder of packet
-            for (unsigned int i = 1; i < size; i++)
+            if (offset + packet_header_size > _data_offset + _data_size) {
+                throw Parse_error_str("page header truncated");
+            }
+            // would end up here after the loop anyways, but without reading past the data first
+            if (next_offset > _data_offset + _data_size) {
+                throw Parse_error_str("page truncated");
+            }
+            offset = next_offset;
+
+            if (pass == 0)
             {
-                int v = _infile_data.data[offset + i];
-                if (v < 0)
-                {
-                    throw Parse_error_str("file truncated");
-                }
-                Bit_uint<8> c(v);
-                os << c;
+                packet_count++;
+                continue;
             }
 
-            offset = next_offset;
-            os.flush_page( false, (offset == _data_offset + _data_size) );
+            packets.offsets.push_back(packet_payload_offset);
+            packets.sizes.push_back(size);
+            packets.granules.push_back(granule);
+
+            if (_mod_packets && mode_bits >= 0)
+            {
+                // the first byte is read even for empty packets, it has to exist
+                Bit_stream ss(_infile_data, packet_payload_offset);
+                Bit_uint<8> first_byte;
+                ss >> first_byte;
+                packets.mode_numbers.push_back(first_byte & ((1U << mode_bits) - 1));
+            }
         }
 
         if (offset > _data_offset + _data_size) throw Parse_error_str("page truncated");
     }
-
-    delete [] mode_blockflag;
 }
 
+template <bool little_endian>
 void Wwise_RIFF_Vorbis::generate_ogg_header_with_triad(Bit_oggstream& os)
 {
     // Header page triad
@@ -1208,7 +1672,7 @@ void Wwise_RIFF_Vorbis::generate_ogg_header_with_triad(Bit_oggstream& os)
 
         // copy information packet
         {
-            Packet_8 information_packet(_infile_data, offset, _little_endian);
+            Packet_8<little_endian> information_packet(_infile_data, offset);
             uint32_t size = information_packet.size();
 
             if (information_packet.granule() != 0)
@@ -1224,10 +1688,9 @@ void Wwise_RIFF_Vorbis::generate_ogg_header_with_triad(Bit_oggstream& os)
 
             os << c;
 
-            for (unsigned int i = 1; i < size; i++)
+            if (size > 1)
             {
-                c = _infile_data.data[information_packet.offset() + i];
-                os << c;
+                os.put_bytes(&_infile_data.data[information_packet.offset() + 1], size - 1);
             }
 
             // identification packet on its own page
@@ -1238,7 +1701,7 @@ void Wwise_RIFF_Vorbis::generate_ogg_header_with_triad(Bit_oggstream& os)
 
         // copy comment packet
         {
-            Packet_8 comment_packet(_infile_data, offset, _little_endian);
+            Packet_8<little_endian> comment_packet(_infile_data, offset);
             uint16_t size = comment_packet.size();
 
             if (comment_packet.granule() != 0)
@@ -1254,10 +1717,9 @@ void Wwise_RIFF_Vorbis::generate_ogg_header_with_triad(Bit_oggstream& os)
 
             os << c;
 
-            for (unsigned int i = 1; i < size; i++)
+            if (size > 1)
             {
-                c = _infile_data.data[comment_packet.offset() + i];
-                os << c;
+                os.put_bytes(&_infile_data.data[comment_packet.offset() + 1], size - 1);
             }
 
             // identification packet on its own page
@@ -1268,7 +1730,7 @@ void Wwise_RIFF_Vorbis::generate_ogg_header_with_triad(Bit_oggstream& os)
 
         // copy setup packet
         {
-            Packet_8 setup_packet(_infile_data, offset, _little_endian);
+            Packet_8<little_endian> setup_packet(_infile_data, offset);
 
             if (setup_packet.granule() != 0) throw Parse_error_str("setup packet granule != 0");
             Bit_stream ss(_infile_data, setup_packet.offset());
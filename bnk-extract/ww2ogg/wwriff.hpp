@@ -5,6 +5,7 @@
 #define __STDC_CONSTANT_MACROS
 #endif
 #include <string>
+#include <vector>
 #include "Bit_stream.hpp"
 #include "stdint.h"
 #include "errors.hpp"
@@ -13,6 +14,10 @@
 
 using namespace std;
 
+class codebook_library;
+struct Audio_chunks;
+struct Audio_chunk;
+
 enum ForcePacketFormat {
     kNoForcePacketFormat,
     kForceModPackets,
@@ -20,10 +25,19 @@ enum ForcePacketFormat {
 };
 
 
+// the audio packets of a wem, read before any of them is converted
+struct Packet_table {
+    vector<uint32_t> offsets; // of the payloads, past the packet headers
+    vector<uint32_t> sizes;
+    vector<uint32_t> granules; // as stored in the wem, 0 for wems without granules
+    vector<uint8_t> mode_numbers; // for mod packets, whose first byte starts with the mode number
+
+    size_t size(void) const { return offsets.size(); }
+};
+
 class Wwise_RIFF_Vorbis
 {
     const AudioData& _infile_data;
-    string _codebooks_name;
 
     bool _little_endian;
     bool _is_wav;
@@ -58,26 +72,41 @@ class Wwise_RIFF_Vorbis
     uint8_t _blocksize_1_pow;
 
     const bool _inline_codebooks, _full_setup;
+    // only used without inline codebooks
+    const codebook_library& _codebooks;
     bool _header_triad_present, _old_packet_headers;
     bool _no_granule, _mod_packets;
 
-    uint16_t (*_read_16)(unsigned char b[4]);
-    uint32_t (*_read_32)(unsigned char b[4]);
+    template <bool little_endian> void parse_chunks(ForcePacketFormat force_packet_format);
+    template <bool little_endian> void scan_packets(Packet_table& packets, int mode_bits);
+    template <bool little_endian> void generate_ogg(OutputSink& sink, Granule_pager* pager, unsigned int thread_count);
+    template <bool little_endian> void generate_ogg_header(Bit_oggstream& os, bool * & mode_blockflag, int & mode_bits);
+    template <bool little_endian> void generate_ogg_header_with_triad(Bit_oggstream& os);
+    void generate_audio_pages(Bit_oggstream& os, const Packet_table& packets, size_t begin, size_t end, const bool* mode_blockflag, int mode_bits) const;
+    bool generate_audio_pages_parallel(OutputSink& sink, Bit_oggstream& os, Granule_pager* pager, const Packet_table& packets,
+                                       const bool* mode_blockflag, int mode_bits, unsigned int thread_count) const;
+    void generate_audio_chunk(const Audio_chunks& audio, Audio_chunk& chunk, size_t end) const;
+    static void* audio_chunk_thread(void* argument);
 public:
     Wwise_RIFF_Vorbis(
       const AudioData& ad,
-      const string& _codebooks_name,
       bool inline_codebooks,
       bool full_setup,
-      ForcePacketFormat force_packet_format
+      ForcePacketFormat force_packet_format,
+      const codebook_library& codebooks
       );
 
     void print_info(void);
 
-    void generate_ogg(BinaryData& bd);
-    void generate_wav_header(BinaryData& bd);
-    void generate_ogg_header(Bit_oggstream& os, bool * & mode_blockflag, int & mode_bits);
-    void generate_ogg_header_with_triad(Bit_oggstream& os);
+    uint32_t get_sample_count(void) const { return _sample_count; }
+    uint32_t get_sample_rate(void) const { return _sample_rate; }
+
+    // for callers that want the duration or positions to seek to without converting
+    void scan_packets(Packet_table& packets);
+
+    // with more than one thread, the audio packets of long wems are split into parts that get paged at the same time
+    void generate_ogg(OutputSink& sink, Granule_pager* pager = NULL, unsigned int thread_count = 1);
+    void generate_wav_header(OutputSink& sink);
 };
 
 #endif
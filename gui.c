@@ -39,7 +39,7 @@ void PlayAudio(AudioData* wemData)
         // MessageBox(mainWindow, "Initializing sound engine failed.\n", "Sound initialization failure", MB_ICONERROR);
         return;
     }
-    BinaryData* oggData = WemToOgg(wemData);
+    BinaryData* oggData = WemToOgg(wemData, 0);
     if (oggData) {
         ReadableBinaryData readableOggData = {
             .data = oggData->data,
@@ -224,11 +224,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
                     if (toBeDeleted.lParam && TreeView_IsRootItem(toBeDeleted.hItem)) { // root item
                         AudioDataList* wemDataList = (AudioDataList*) toBeDeleted.lParam;
                         printf("deleting list %p\n", wemDataList);
-                        for (uint32_t i = 0; i < wemDataList->length; i++) {
-                            free(wemDataList->objects[i].data);
-                        }
-                        free(wemDataList->objects);
-                        free(wemDataList);
+                        free_audio_data_list(wemDataList);
                     }
                     return 0;
                 }
@@ -262,6 +258,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
                         InsertStringToTreeview(wemInformation->grouped_wems, TVI_ROOT);
                         ShowWindow(treeview, SW_SHOWNORMAL);
                         free(wemInformation->grouped_wems);
+                        free_wem_events(wemInformation->wem_events);
                         free(wemInformation);
                     } else {
                         int stderr_length = ftell(temp_file);
@@ -11,6 +11,7 @@
 #include "settings.h"
 #include "treeview_extension.h"
 #include "bnk-extract/api.h"
+#include "bnk-extract/ww2ogg/api.h"
 #include "vorbis/vorbisfile.h"
 
 static size_t read_func_callback(void* ptr, size_t size, size_t nmemb, void* datasource)
@@ -175,6 +176,8 @@ void SaveBnkOrWpk(HWND window, HTREEITEM root)
         .cchTextMax = 255
     };
     TreeView_GetItem(treeview, &tvItem);
+    char sourcePath[MAX_PATH];
+    GetFullPathName(itemText, MAX_PATH, sourcePath, NULL);
 
     OPENFILENAME fileNameInfo = {
         .lStructSize = sizeof(OPENFILENAME),
@@ -187,6 +190,11 @@ void SaveBnkOrWpk(HWND window, HTREEITEM root)
     if (GetSaveFileName(&fileNameInfo)) {
         char* selectedFile = fileNameInfo.lpstrFile;
         printf("selected file: \"%s\"\n", selectedFile);
+        char selectedFullPath[MAX_PATH];
+        GetFullPathName(selectedFile, MAX_PATH, selectedFullPath, NULL);
+        // the wem data may still point into the mapped source file, so it can't be overwritten in place
+        if (_stricmp(sourcePath, selectedFullPath) == 0)
+            detach_audio_data_list((AudioDataList*) tvItem.lParam);
         if (strstr(selectedFile, ".wpk")) {
             write_wpk_file((AudioDataList*) tvItem.lParam, selectedFile);
         } else {
@@ -276,19 +284,29 @@ void ReplaceWemData(HWND window)
                 continue;
             }
             fseek(newDataFile, 0, SEEK_END);
-            selectedChildItemsDataList.objects[i]->length = ftell(newDataFile);
-            free(selectedChildItemsDataList.objects[i]->data);
-            selectedChildItemsDataList.objects[i]->data = malloc(selectedChildItemsDataList.objects[i]->length);
+            uint32_t newDataLength = ftell(newDataFile);
+            uint8_t* newData = malloc(newDataLength);
             rewind(newDataFile);
-            fread(selectedChildItemsDataList.objects[i]->data, selectedChildItemsDataList.objects[i]->length, 1, newDataFile);
+            fread(newData, newDataLength, 1, newDataFile);
             fclose(newDataFile);
+            replace_audio_data(selectedChildItemsDataList.objects[i], newData, newDataLength);
         }
     }
     free(fileNameBuffer);
     free(selectedChildItemsDataList.objects);
 }
 
-static void ExtractItems(HTREEITEM hItem, wchar_t* output_path)
+typedef struct {
+    wchar_t* path; // with a placeholder extension that gets replaced once the first converted bytes are known
+    FILE* file; // opened with the first bytes written
+} OggOutput;
+
+typedef struct {
+    LIST(AudioData*) wems;
+    LIST(OggOutput) outputs;
+} PendingOggs;
+
+static void ExtractItems(HTREEITEM hItem, wchar_t* output_path, PendingOggs* pendingOggs)
 {
     // check whether this is a "global" root item. If so, do not use its (path-like) label text and abuse the fact "//" is equivalent to "/"
     bool isRootItem = TreeView_IsRootItem(hItem);
@@ -319,24 +337,11 @@ static void ExtractItems(HTREEITEM hItem, wchar_t* output_path)
             fclose(output_file);
         }
 
-        if (settings[ID_EXTRACT_AS_OGG-SETTINGS_OFFSET]) { // should be extracted as ogg
+        if (settings[ID_EXTRACT_AS_OGG-SETTINGS_OFFSET]) { // should be extracted as ogg, done for all items at once afterwards
             AudioData* wemData = (AudioData*) tvItem.lParam;
-            BinaryData* oggData = WemToOgg(wemData);
-            if (oggData) { // some rare wem files fail to convert. Just ignore them silently here; it's not worth it
-                if (oggData->length >= 4 && memcmp(oggData->data, "RIFF", 4) == 0) // it's actually wav data
-                    _swprintf(current_output_path + wcslen(current_output_path) - 3, L"wav");
-                else
-                    _swprintf(current_output_path + wcslen(current_output_path) - 3, L"ogg");
-                FILE* output_file = _wfopen(current_output_path, L"wb");
-                if (!output_file) {
-                    MessageBoxW(NULL, L"Failed to open an ogg output file. Which one is still a mystery which needs to be uncovered", current_output_path, MB_ICONWARNING);
-                    return;
-                }
-                fwrite(oggData->data, oggData->length, 1, output_file);
-                fclose(output_file);
-                free(oggData->data);
-                free(oggData);
-            }
+            OggOutput output = {.path = _wcsdup(current_output_path)};
+            add_object(&pendingOggs->wems, &wemData);
+            add_object(&pendingOggs->outputs, &output);
         }
     } else if (tvItem.cChildren > 0) { // item is a parent item, so extract all children
         // note that cChildren > 0 *should* always be true here
@@ -344,11 +349,54 @@ static void ExtractItems(HTREEITEM hItem, wchar_t* output_path)
         HTREEITEM child = TreeView_GetChild(treeview, hItem);
 
         do {
-            ExtractItems(child, current_output_path);
+            ExtractItems(child, current_output_path, pendingOggs);
         } while ( (child = TreeView_GetNextSibling(treeview, child)) );
     }
 }
 
+// runs on the calling thread, which writes all outputs while the wems are converted
+static int WriteOggPiece(const uint8_t* data, uint64_t length, void* _output)
+{
+    OggOutput* output = _output;
+    if (!output->file) {
+        if (length >= 4 && memcmp(data, "RIFF", 4) == 0) // it's actually wav data
+            _swprintf(output->path + wcslen(output->path) - 3, L"wav");
+        else
+            _swprintf(output->path + wcslen(output->path) - 3, L"ogg");
+        output->file = _wfopen(output->path, L"wb");
+        if (!output->file) {
+            MessageBoxW(NULL, L"Failed to open an ogg output file. Which one is still a mystery which needs to be uncovered", output->path, MB_ICONWARNING);
+            return -1;
+        }
+    }
+
+    return fwrite(data, length, 1, output->file) == 1 ? 0 : -1;
+}
+
+// for the converted oggs that wait to be written and the wems read ahead of them
+#define EXTRACTION_MEMORY_CAP (256 * 1024 * 1024)
+
+static bool OpenOggOutput(uint32_t index, AudioData* wemData, OutputSink* sink, void* _pendingOggs)
+{
+    (void) wemData;
+    PendingOggs* pendingOggs = _pendingOggs;
+    begin_callback_output(sink, WriteOggPiece, &pendingOggs->outputs.objects[index]);
+    return true;
+}
+
+static void CloseOggOutput(uint32_t index, AudioData* wemData, OutputSink* sink, int status, void* _pendingOggs)
+{
+    (void) wemData;
+    (void) sink;
+    PendingOggs* pendingOggs = _pendingOggs;
+    OggOutput* output = &pendingOggs->outputs.objects[index];
+    if (!output->file)
+        return;
+    fclose(output->file);
+    if (status == -1) // some rare wem files fail to convert, possibly halfway through. Just remove what was written silently; it's not worth it
+        _wremove(output->path);
+}
+
 static wchar_t* GetOpenFolderName(HWND parent)
 {
     IFileDialog* pFileDialog;
@@ -374,10 +422,24 @@ void ExtractSelectedItems(HWND parent)
     if (!selectedFolder) return;
     printf("selected output folder: \"%ls\"\n", selectedFolder);
 
+    PendingOggs pendingOggs;
+    initialize_list(&pendingOggs.wems);
+    initialize_list(&pendingOggs.outputs);
     HTREEITEM selectedItem = NULL;
     while ( (selectedItem = TreeView_GetNextSelected(treeview, selectedItem)) ) {
-        ExtractItems(selectedItem, selectedFolder);
+        ExtractItems(selectedItem, selectedFolder, &pendingOggs);
+    }
+
+    // the gui never loads wems on demand, so no list is needed to get to their data
+    stream_wems(NULL, pendingOggs.wems.objects, pendingOggs.wems.length, 0, EXTRACTION_MEMORY_CAP, OpenOggOutput, CloseOggOutput, &pendingOggs);
+    struct ww2ogg_setup_cache_stats setupCacheStats;
+    ww2ogg_get_setup_cache_stats(&setupCacheStats);
+    printf("reused setup headers: %llu, rebuilt: %llu\n", (unsigned long long) setupCacheStats.hits, (unsigned long long) setupCacheStats.misses);
+    for (uint32_t i = 0; i < pendingOggs.outputs.length; i++) {
+        free(pendingOggs.outputs.objects[i].path);
     }
+    free(pendingOggs.wems.objects);
+    free(pendingOggs.outputs.objects);
 
     CoTaskMemFree(selectedFolder);
 }